@@ -0,0 +1,77 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define CHUNK_LEN 4096
+#define ALIGN 16
+
+struct chunk
+{
+	struct chunk *next;
+	size_t size;
+	/* Keeps the data aligned. */
+	long double data[];
+};
+
+void *aralloc(struct arena *a, size_t size)
+{
+	size = (size + ALIGN - 1) & ~(size_t) (ALIGN - 1);
+	if (a->cur != NULL && a->cur->size - a->used >= size) {
+		void *p = (char *) a->cur->data + a->used;
+		a->used += size;
+		return p;
+	}
+	/* Move on to the next chunk we kept around, or make a new one. */
+	struct chunk *c = a->cur != NULL ? a->cur->next : a->first;
+	if (c == NULL || c->size < size) {
+		size_t csize = size > CHUNK_LEN ? size : CHUNK_LEN;
+		struct chunk *n = malloc(sizeof(*n) + csize);
+		if (n == NULL) return NULL;
+		n->size = csize;
+		n->next = c;
+		if (a->cur != NULL) a->cur->next = n;
+		else a->first = n;
+		c = n;
+	}
+	a->cur = c;
+	a->used = size;
+	return c->data;
+}
+
+char *arstrdup(struct arena *a, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *p = aralloc(a, len);
+	if (p != NULL) memcpy(p, str, len);
+	return p;
+}
+
+void arreset(struct arena *a)
+{
+	a->cur = NULL;
+	a->used = 0;
+}
+
+void artrim(struct arena *a)
+{
+	if (a->first != NULL) {
+		struct chunk *c = a->first->next;
+		a->first->next = NULL;
+		while (c != NULL) {
+			struct chunk *next = c->next;
+			free(c);
+			c = next;
+		}
+	}
+	arreset(a);
+}
+
+void arfree(struct arena *a)
+{
+	artrim(a);
+	free(a->first);
+	a->first = NULL;
+}
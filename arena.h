@@ -0,0 +1,26 @@
+/* See LICENSE file for copyright and license details. */
+
+/* A bump allocator for state that is thrown away all at once, like that of
+ * a mail transaction. Memory is only returned to the system by arfree(), so
+ * an arena that is reset and reused soon stops calling malloc() at all. */
+
+struct chunk;
+
+struct arena
+{
+	struct chunk *first;
+	/* The chunk that allocations come from right now, and its fill level. */
+	struct chunk *cur;
+	size_t used;
+};
+
+/* Returns size bytes of suitably aligned memory, or NULL if out of memory. */
+void *aralloc(struct arena *a, size_t size);
+/* Copies a string into the arena. */
+char *arstrdup(struct arena *a, const char *str);
+/* Forgets about all allocations, but keeps their memory for reuse. */
+void arreset(struct arena *a);
+/* Like arreset(), but also gives back all chunks except the first one. */
+void artrim(struct arena *a);
+/* Releases all memory of the arena. */
+void arfree(struct arena *a);
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Measures a freshly built bmaild with bmailbench. The daemon gets a spool and
+# config of its own in a temporary directory, and listens on $BENCH_PORT.
+# bmaild chroots into the spool, so this has to run as root. If BENCH_CERT and
+# BENCH_KEY name a certificate and key, STARTTLS is measured as well.
+
+port=${BENCH_PORT:-2525}
+user=${BENCH_USER:-nobody}
+group=${BENCH_GROUP:-nogroup}
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/bmailbench.XXXXXX") || exit 1
+pid=
+trap '[ -n "$pid" ] && kill $pid; rm -rf "$dir"' EXIT
+trap 'exit 1' INT TERM
+
+mkdir -p "$dir/spool/bench" "$dir/spool/.queue/msg" "$dir/spool/.queue/env" "$dir/spool/.queue/tmp"
+chown -R "$user:$group" "$dir/spool" || exit 1
+cat > "$dir/bmail.conf" <<CONF
+domain = "localhost"
+spool = "$dir/spool"
+user = "$user"
+group = "$group"
+ports = "$port"
+CONF
+if [ -n "$BENCH_CERT" ] && [ -n "$BENCH_KEY" ]; then
+	cat >> "$dir/bmail.conf" <<CONF
+tls_enable = "YES"
+cert_file = "$BENCH_CERT"
+key_file = "$BENCH_KEY"
+CONF
+fi
+
+BMAILRC="$dir/bmail.conf" ./bmaild 2>"$dir/log" &
+pid=$!
+sleep 1
+
+run() {
+	./bmailbench -p "$port" "$@" || exit 1
+	echo
+}
+
+run -s helo -n 5000
+run -s rcpts -r 100 -n 200
+run -s data -b 1000000 -n 100
+run -s pipeline -r 10 -m 10 -n 500
+if [ -n "$BENCH_CERT" ] && [ -n "$BENCH_KEY" ]; then
+	run -s starttls -n 500
+fi
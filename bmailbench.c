@@ -0,0 +1,411 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Generates SMTP load against a running bmaild. Many clients run the same
+ * script concurrently, each one session after the other, until the requested
+ * number of sessions is done. Then the throughput and the latency of every
+ * command are reported. Each client is a process of its own, and keeps its
+ * numbers in shared memory for the parent to sum up. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <tls.h>
+
+#include "util.h"
+
+#define MAX_CLIENTS 256
+#define MAX_RCPTS 1000
+#define LINE_LEN 1024
+/* Latencies are counted in histograms with 16 buckets per power of two of
+ * microseconds, which is precise to about 6%, up to 2^40 us. */
+#define SUB_BITS 4
+#define NUM_BUCKETS (41 << SUB_BITS)
+
+enum {
+	SC_HELO,     /* Just greet and leave. */
+	SC_RCPTS,    /* One command at a time, usually with many recipients. */
+	SC_DATA,     /* The same, usually with a large body. */
+	SC_PIPELINE, /* Send MAIL, all RCPTs and DATA at once. */
+	SC_STARTTLS, /* Like SC_DATA, but over TLS. */
+	NUM_SCRIPTS
+};
+
+static const char *scriptnames[NUM_SCRIPTS] = {
+	"helo", "rcpts", "data", "pipeline", "starttls",
+};
+
+/* What latencies are measured for. */
+enum {
+	L_GREETING, /* From connect() to the greeting. */
+	L_EHLO,
+	L_STARTTLS, /* Including the handshake. */
+	L_MAIL,
+	L_RCPT,
+	L_DATA,
+	L_PIPELINE, /* MAIL, all RCPTs and DATA. */
+	L_BODY,     /* From the first byte of the body to the final reply. */
+	L_QUIT,
+	NUM_LATS
+};
+
+static const char *latnames[NUM_LATS] = {
+	"greeting", "ehlo", "starttls", "mail", "rcpt", "data", "pipeline", "body", "quit",
+};
+
+struct result
+{
+	unsigned long sessions;
+	unsigned long messages;
+	unsigned long bytes;
+	unsigned long errors;
+	unsigned long hist[NUM_LATS][NUM_BUCKETS];
+};
+
+struct shared
+{
+	/* Sessions that no client has started yet. */
+	long left;
+	struct result res[MAX_CLIENTS];
+};
+
+static struct shared *sh;
+static struct result *res;
+
+/* Options */
+static const char *host = "127.0.0.1";
+static const char *port = "25";
+static int clients = 16;
+static long sessions = 1000;
+static int script = SC_DATA;
+static int nrcpts = 1;
+static int messages = 1;
+static size_t bodylen = 4096;
+static const char *rcptaddr = "bench@localhost";
+
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+static struct tls_config *tlscfg;
+static char *body;
+static char **rcptcmds;
+static char *pipecmds;
+
+/* The connection of the current session. */
+static int sock;
+static struct tls *tls;
+static char in[4096];
+static int inhead, intail;
+
+static unsigned long now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int bucket(unsigned long us)
+{
+	if (us < (1 << SUB_BITS)) return us;
+	int e = CHAR_BIT * sizeof(us) - 1 - __builtin_clzl(us);
+	int b = ((e - SUB_BITS + 1) << SUB_BITS) + ((us >> (e - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+	return b < NUM_BUCKETS ? b : NUM_BUCKETS - 1;
+}
+
+/* The smallest latency that falls into bucket b. */
+static unsigned long bucketmin(int b)
+{
+	if (b < (1 << SUB_BITS)) return b;
+	int e = (b >> SUB_BITS) + SUB_BITS - 1;
+	unsigned long sub = b & ((1 << SUB_BITS) - 1);
+	return ((1UL << SUB_BITS) + sub) << (e - SUB_BITS);
+}
+
+static void record(int lat, unsigned long start)
+{
+	++res->hist[lat][bucket(now() - start)];
+}
+
+static int sendall(const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n;
+		if (tls != NULL) {
+			n = tls_write(tls, buf, len);
+			if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT) continue;
+		} else {
+			n = write(sock, buf, len);
+			if (n < 0 && errno == EINTR) continue;
+		}
+		if (n <= 0) return 0;
+		buf += n, len -= n;
+	}
+	return 1;
+}
+
+static int readline(char line[])
+{
+	int len = 0;
+	for (;;) {
+		while (inhead < intail) {
+			char c = in[inhead++];
+			if (len < LINE_LEN - 1) line[len++] = c;
+			if (c == '\n') {
+				line[len] = '\0';
+				return 1;
+			}
+		}
+		ssize_t n;
+		if (tls != NULL) {
+			n = tls_read(tls, in, sizeof(in));
+			if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT) continue;
+		} else {
+			n = read(sock, in, sizeof(in));
+			if (n < 0 && errno == EINTR) continue;
+		}
+		if (n <= 0) return 0;
+		inhead = 0, intail = n;
+	}
+}
+
+/* Reads a possibly multi-line reply and returns its code, or -1 if the
+ * connection broke. */
+static int reply(void)
+{
+	char line[LINE_LEN];
+	do {
+		if (!readline(line) || strlen(line) < 4) return -1;
+	} while (line[3] == '-');
+	return atoi(line);
+}
+
+/* Sends cmd and checks that the reply has the expected code. */
+static int command(int lat, const char *cmd, int expect)
+{
+	unsigned long start = now();
+	if (!sendall(cmd, strlen(cmd))) return 0;
+	int code = reply();
+	record(lat, start);
+	return code == expect;
+}
+
+static int transaction(void)
+{
+	if (script == SC_PIPELINE) {
+		unsigned long start = now();
+		if (!sendall(pipecmds, strlen(pipecmds))) return 0;
+		int ok = 1;
+		for (int i = 0; i < 1 + nrcpts; ++i) {
+			if (reply() != 250) ok = 0;
+		}
+		if (reply() != 354) return 0;
+		record(L_PIPELINE, start);
+		if (!ok) return 0;
+	} else {
+		if (!command(L_MAIL, "MAIL FROM:<bench@bench.test>\r\n", 250)) return 0;
+		for (int i = 0; i < nrcpts; ++i) {
+			if (!command(L_RCPT, rcptcmds[i], 250)) return 0;
+		}
+		if (!command(L_DATA, "DATA\r\n", 354)) return 0;
+	}
+	unsigned long start = now();
+	if (!sendall(body, strlen(body))) return 0;
+	int code = reply();
+	record(L_BODY, start);
+	if (code != 250) return 0;
+	++res->messages;
+	res->bytes += bodylen;
+	return 1;
+}
+
+static int session(void)
+{
+	const int yes = 1;
+	int ok = 0;
+	inhead = intail = 0;
+	tls = NULL;
+	unsigned long start = now();
+	if ((sock = socket(addr.ss_family, SOCK_STREAM, 0)) < 0) return 0;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	if (connect(sock, (struct sockaddr *) &addr, addrlen) < 0) goto out;
+	if (reply() != 220) goto out;
+	record(L_GREETING, start);
+	if (!command(L_EHLO, "EHLO bench.test\r\n", 250)) goto out;
+	if (script == SC_STARTTLS) {
+		start = now();
+		if (!sendall("STARTTLS\r\n", 10) || reply() != 220) goto out;
+		if ((tls = tls_client()) == NULL) goto out;
+		if (tls_configure(tls, tlscfg) < 0) goto out;
+		if (tls_connect_socket(tls, sock, "localhost") < 0) goto out;
+		if (tls_handshake(tls) < 0) goto out;
+		record(L_STARTTLS, start);
+		inhead = intail = 0;
+		if (!command(L_EHLO, "EHLO bench.test\r\n", 250)) goto out;
+	}
+	if (script != SC_HELO) {
+		for (int m = 0; m < messages; ++m) {
+			if (!transaction()) goto out;
+		}
+	}
+	ok = command(L_QUIT, "QUIT\r\n", 221);
+out:
+	if (tls != NULL) {
+		tls_close(tls);
+		tls_free(tls);
+	}
+	close(sock);
+	return ok;
+}
+
+static void client(int c)
+{
+	res = &sh->res[c];
+	while (__atomic_sub_fetch(&sh->left, 1, __ATOMIC_RELAXED) >= 0) {
+		if (session()) ++res->sessions;
+		else ++res->errors;
+	}
+	_exit(0);
+}
+
+/* Prepares everything that all sessions send. */
+static void prepare(void)
+{
+	/* A body of lines of up to 78 characters, then the end-of-data marker. */
+	if (bodylen == 1) die("The body must be empty or at least 2 bytes long.");
+	if ((body = malloc(bodylen + 4)) == NULL) die("malloc:");
+	size_t len = 0;
+	while (len < bodylen) {
+		size_t n = bodylen - len < 78 ? bodylen - len : 78;
+		/* Don't leave a single byte for the last line. */
+		if (bodylen - len - n == 1) --n;
+		memset(body + len, 'x', n - 2);
+		memcpy(body + len + n - 2, "\r\n", 2);
+		len += n;
+	}
+	strcpy(body + len, ".\r\n");
+	/* The first recipient is the given one, the rest are spread over other domains. */
+	if ((rcptcmds = calloc(nrcpts, sizeof(rcptcmds[0]))) == NULL) die("calloc:");
+	if ((pipecmds = malloc(64 + (size_t) nrcpts * (strlen(rcptaddr) + 64))) == NULL) die("malloc:");
+	strcpy(pipecmds, "MAIL FROM:<bench@bench.test>\r\n");
+	for (int i = 0; i < nrcpts; ++i) {
+		if ((rcptcmds[i] = malloc(strlen(rcptaddr) + 64)) == NULL) die("malloc:");
+		if (i == 0) sprintf(rcptcmds[i], "RCPT TO:<%s>\r\n", rcptaddr);
+		else sprintf(rcptcmds[i], "RCPT TO:<rcpt%d@d%d.bench.test>\r\n", i, i % 8);
+		strcat(pipecmds, rcptcmds[i]);
+	}
+	strcat(pipecmds, "DATA\r\n");
+	if (script == SC_STARTTLS) {
+		if ((tlscfg = tls_config_new()) == NULL) die("tls_config_new:");
+		/* Only ever used against a local test server. */
+		tls_config_insecure_noverifycert(tlscfg);
+		tls_config_insecure_noverifyname(tlscfg);
+	}
+}
+
+static void report(double secs)
+{
+	struct result sum;
+	memset(&sum, 0, sizeof(sum));
+	for (int c = 0; c < clients; ++c) {
+		struct result *r = &sh->res[c];
+		sum.sessions += r->sessions;
+		sum.messages += r->messages;
+		sum.bytes += r->bytes;
+		sum.errors += r->errors;
+		for (int l = 0; l < NUM_LATS; ++l) {
+			for (int b = 0; b < NUM_BUCKETS; ++b) sum.hist[l][b] += r->hist[l][b];
+		}
+	}
+	printf("%s: %d clients, %lu sessions, %lu errors in %.3f s\n",
+		scriptnames[script], clients, sum.sessions, sum.errors, secs);
+	printf("sessions/s %.1f\n", sum.sessions / secs);
+	printf("messages/s %.1f\n", sum.messages / secs);
+	printf("MB/s %.2f\n", sum.bytes / secs / 1e6);
+	printf("%-10s %10s %10s %10s %10s (us)\n", "command", "count", "p50", "p99", "p999");
+	for (int l = 0; l < NUM_LATS; ++l) {
+		unsigned long count = 0;
+		for (int b = 0; b < NUM_BUCKETS; ++b) count += sum.hist[l][b];
+		if (count == 0) continue;
+		static const double qs[] = { 0.5, 0.99, 0.999 };
+		unsigned long p[3];
+		for (int q = 0; q < 3; ++q) {
+			unsigned long rank = (unsigned long) (qs[q] * (count - 1)), seen = 0;
+			int b = 0;
+			while ((seen += sum.hist[l][b]) <= rank) ++b;
+			p[q] = bucketmin(b);
+		}
+		printf("%-10s %10lu %10lu %10lu %10lu\n", latnames[l], count, p[0], p[1], p[2]);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: bmailbench [-h host] [-p port] [-c clients] [-n sessions]\n"
+		"                  [-s helo|rcpts|data|pipeline|starttls] [-r rcpts]\n"
+		"                  [-m messages] [-b bodybytes] [-a rcptaddr]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:c:n:s:r:m:b:a:")) != -1) {
+		switch (opt) {
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'c': clients = atoi(optarg); break;
+		case 'n': sessions = atol(optarg); break;
+		case 's':
+			for (script = 0; script < NUM_SCRIPTS; ++script) {
+				if (strcmp(optarg, scriptnames[script]) == 0) break;
+			}
+			if (script == NUM_SCRIPTS) usage();
+			break;
+		case 'r': nrcpts = atoi(optarg); break;
+		case 'm': messages = atoi(optarg); break;
+		case 'b': bodylen = strtoul(optarg, NULL, 10); break;
+		case 'a': rcptaddr = optarg; break;
+		default: usage();
+		}
+	}
+	if (optind != argc) usage();
+	if (clients < 1 || clients > MAX_CLIENTS) die("There must be 1 to %d clients.", MAX_CLIENTS);
+	if (nrcpts < 1 || nrcpts > MAX_RCPTS) die("There must be 1 to %d recipients.", MAX_RCPTS);
+	if (messages < 1) die("There must be at least one message per session.");
+
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int eai = getaddrinfo(host, port, &hints, &ai);
+	if (eai != 0) die("getaddrinfo: %s", gai_strerror(eai));
+	memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+	addrlen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	prepare();
+	sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED) die("mmap:");
+	sh->left = sessions;
+	signal(SIGPIPE, SIG_IGN);
+
+	unsigned long start = now();
+	for (int c = 0; c < clients; ++c) {
+		pid_t pid = fork();
+		if (pid < 0) die("fork:");
+		if (pid == 0) client(c);
+	}
+	while (wait(NULL) > 0 || errno == EINTR);
+	report((now() - start) / 1e6);
+	return 0;
+}
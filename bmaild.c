@@ -1,30 +1,80 @@
 /* See LICENSE file for copyright and license details. */
 
+#define _GNU_SOURCE /* for CPU affinity */
+
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
 #include <netdb.h>
-#include <fcntl.h>
 #include <poll.h>
-/* #include <signal.h> */
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <tls.h>
 
 #include "util.h"
 #include "conf.h"
 #include "conn.h"
+#include "smtp.h"
+#include "recv.h"
+#include "peers.h"
+#include "event.h"
+#include "mbox.h"
+#include "queue.h"
+#include "env.h"
+#include "rcptidx.h"
+#include "stats.h"
 
-#define MAX_SOCKS 10
+#define MAX_PORTS 8
+#define MAX_WORKERS 1024
 
 char my_domain[256];
+/* Whether BDAT chunks on plaintext connections are spooled with splice(),
+ * which is the default. Set splice_data to NO to always spool through the
+ * input buffer. */
+int splice_data;
+int durability;
+int queue_shards;
+int envelope_format;
 
-static const char *ports[] = { "25", "587", NULL };
+static char *ports[MAX_PORTS+1];
+static int backlog;
+static int defer_accept;
+static int fastopen;
 
 static struct tls *tlssrv = NULL;
-static int socks[MAX_SOCKS];
-static struct pollfd pfds[MAX_SOCKS];
+/* One set of listening sockets per worker, or just one in fork mode. */
+static int (*socks)[MAX_SOCKS];
+/* The listening sockets, the recipient index watch and the stats socket. */
+static struct pollfd pfds[MAX_SOCKS+2];
 static int nsocks;
-
-extern void recvmail(void);
+static int idxfd;
+static int statfd = -1;
+static int workers;
+static pid_t *wpids;
+/* Set by SIGUSR1, which asks the master to write out the counters. */
+static volatile sig_atomic_t wantstats;
+/* CPU to pin each worker to, or -1. */
+static int *wcpus;
+/* In fork mode, the process of every open session, so that its place can be
+ * given back however it ends. */
+struct child
+{
+	pid_t pid;
+	/* The listening socket that the session came from. */
+	int sock;
+	struct peerref peer;
+};
+static struct child *children;
+static int nchildren, maxchildren;
 
 static void teardown(int sig)
 {
@@ -33,12 +83,38 @@ static void teardown(int sig)
 	_exit(1);
 }
 
-int main()
+static void stopworkers(int sig)
 {
-	const char *conf[NUM_CF_FIELDS];
-	struct tls_config *tlscfg;
+	(void) sig;
+	/* Whatever stopped the master, the workers must go with it. */
+	for (int w = 0; w < workers; ++w) {
+		if (wpids[w] > 0) kill(wpids[w], SIGTERM);
+	}
+	for (int w = 0; w < workers; ++w) {
+		if (wpids[w] > 0) waitpid(wpids[w], NULL, 0);
+	}
+	_exit(1);
+}
 
+static void askstats(int sig)
+{
+	(void) sig;
+	wantstats = 1;
+}
+
+static void dumpstats(void)
+{
+	if (!wantstats) return;
+	wantstats = 0;
+	statdump(stderr);
+}
+
+/* Opens a listening socket for every address of every port in set.
+ * With reuseport, several sets can be bound to the same addresses. */
+static int openlisteners(int set[], int reuseport, int cpu)
+{
 	const int yes = 1;
+	int n = 0;
 	for (int p = 0; ports[p] != NULL; ++p) {
 		struct addrinfo hints, *list, *ai;
 		/* List all plausible addresses to listen on */
@@ -50,41 +126,238 @@ int main()
 		if (eai != 0) die("getaddrinfo: %s", gai_strerror(eai));
 		/* Open sockets for all addresses */
 		for (ai = list; ai != NULL; ai = ai->ai_next) {
-			if (nsocks >= MAX_SOCKS) die("Trying to open too many sockets.");
-			int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (n >= MAX_SOCKS) die("Trying to open too many sockets.");
+			/* Close-on-exec so child processes don't have access to the master sockets. */
+			int sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				ai->ai_protocol);
 			if (sock < 0) die("socket:");
 			/* Get rid of "Address already in use" problems */
 			if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0)
 				die("Can't enable address reuse:");
+			/* Let the kernel balance connections between the workers' sockets. */
+			if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0)
+				die("Can't enable port reuse:");
+			/* Prefer this socket for connections arriving on its worker's CPU. */
+			if (cpu >= 0 && setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0)
+				die("Can't set incoming CPU:");
 			/* Disable ipv4 tunneling through ipv6, as it's not entirely portable. */
 			if (ai->ai_family == AF_INET6) {
 				if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) < 0)
 					die("Can't disable ipv4-mapped ipv6:");
 			}
-			/* Set close-on-exec flag so child processes don't have access to the master sockets. */
-			int flags = fcntl(sock, F_GETFD, 0);
-			if (flags < 0) die("fcntl:");
-			flags = fcntl(sock, F_SETFD, flags | FD_CLOEXEC);
-			if (flags < 0) die("fcntl:");
-			/* Configure socket to be non-blocking. */
-			flags = fcntl(sock, F_GETFL, 0);
-			if (flags < 0) die("fcntl:");
-			flags = fcntl(sock, F_SETFL, flags | O_NONBLOCK);
-			if (flags < 0) die("fcntl:");
+			/* Only hand out connections once the client has sent something, or
+			 * after that many seconds. SMTP clients wait for the greeting, so
+			 * this only sorts out those that never get that far. */
+			if (defer_accept > 0 && setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			    &defer_accept, sizeof(defer_accept)) < 0)
+				die("Can't defer accepting:");
+			/* Queue length for TCP Fast Open connections that are pending. */
+			if (fastopen > 0 && setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+			    &fastopen, sizeof(fastopen)) < 0)
+				die("Can't enable TCP Fast Open:");
 			/* Bind and listen */
 			if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) die("bind:");
-			if (listen(sock, 8) < 0) die("listen:");
-			/* Initialize poll file descriptor */
-			struct pollfd pfd = { 0 };
-			pfd.fd = sock;
-			pfd.events = POLLIN;
-			/* Add to socket array */
-			pfds[nsocks] = pfd;
-			socks[nsocks] = sock;
-			++nsocks;
+			if (listen(sock, backlog) < 0) die("listen:");
+			set[n++] = sock;
 		}
 		freeaddrinfo(list);
 	}
+	return n;
+}
+
+static void nothing(int sig)
+{
+	(void) sig;
+}
+
+/* Counts the sessions whose processes have ended out again. */
+static void reapsessions(void)
+{
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		for (int c = 0; c < nchildren; ++c) {
+			if (children[c].pid != pid) continue;
+			loadgive(children[c].sock, &children[c].peer);
+			children[c] = children[--nchildren];
+			break;
+		}
+	}
+}
+
+/* Fallback concurrency model: Fork off one process per connection. */
+static void forkloop(void)
+{
+	for (int i = 0; i < nsocks; ++i) {
+		pfds[i].fd = socks[0][i];
+		pfds[i].events = POLLIN;
+	}
+	pfds[nsocks].fd = idxfd;
+	pfds[nsocks].events = POLLIN;
+	pfds[nsocks+1].fd = statfd;
+	pfds[nsocks+1].events = POLLIN;
+	sigset_t sigs, orig;
+	/* SIGCHLD and SIGUSR1 may only interrupt ppoll(), so none goes unnoticed. */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sigs, &orig);
+	struct sigaction sa = { .sa_handler = nothing };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	for (;;) {
+		dumpstats();
+		reapsessions();
+		if (ppoll(pfds, nsocks + 2, NULL, &orig) < 0) {
+			if (errno != EINTR) ioerr("ppoll");
+			continue;
+		}
+		if (pfds[nsocks].revents & POLLIN) idxupdate();
+		if (pfds[nsocks+1].revents & POLLIN) statserve(statfd);
+		for (int i = 0; i < nsocks; ++i) {
+			if (!(pfds[i].revents & POLLIN)) continue;
+			struct peerref ref;
+			int s;
+			while ((s = loadaccept(socks[0][i], i, SOCK_CLOEXEC, &ref)) >= 0) {
+				if (nchildren == maxchildren) {
+					maxchildren = maxchildren ? 2 * maxchildren : 64;
+					children = realloc(children, maxchildren * sizeof(children[0]));
+					if (children == NULL) die("realloc:");
+				}
+				pid_t pid = fork();
+				if (pid < 0) {
+					ioerr("fork");
+					loadgive(i, &ref);
+				} else if (pid == 0) {
+					close(idxfd);
+					if (statfd >= 0) close(statfd);
+					signal(SIGCHLD, SIG_DFL);
+					sigprocmask(SIG_SETMASK, &orig, NULL);
+					signal(SIGPIPE, SIG_IGN);
+					recvmail(s, tlssrv);
+				} else {
+					/* However the session ends, the master frees its place. */
+					children[nchildren++] = (struct child) { .pid = pid, .sock = i, .peer = ref };
+				}
+				close(s);
+			}
+		}
+	}
+}
+
+static pid_t spawnworker(int w)
+{
+	pid_t pid = fork();
+	if (pid != 0) return pid;
+	handlesignals(teardown);
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGUSR1);
+	sigprocmask(SIG_UNBLOCK, &sigs, NULL);
+	signal(SIGCHLD, SIG_DFL);
+	close(idxfd);
+	if (statfd >= 0) close(statfd);
+	/* Only keep our own set of listening sockets. */
+	for (int o = 0; o < workers; ++o) {
+		if (o == w) continue;
+		for (int i = 0; i < nsocks; ++i) close(socks[o][i]);
+	}
+	if (wcpus[w] >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(wcpus[w], &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			ioerr("sched_setaffinity");
+	}
+	evloop(socks[w], nsocks, w, tlssrv);
+	return 0;
+}
+
+/* Notes that a worker has died, and when it may be restarted. */
+static void reap(pid_t pid, int status, const time_t started[], time_t restart[])
+{
+	for (int w = 0; w < workers; ++w) {
+		if (wpids[w] != pid) continue;
+		fprintf(stderr, "! worker %d exited with status %d, restarting.\n", w, status);
+		loadclear(w);
+		peerclear(w);
+		wpids[w] = -1;
+		/* Don't spin if a worker keeps dying right away. */
+		restart[w] = started[w] + 1;
+	}
+}
+
+/* Restarts the dead workers that are due. Returns how many seconds until
+ * the next one is, or -1 if none is waiting. */
+static int respawn(time_t started[], time_t restart[])
+{
+	time_t now = time(NULL), next = 0;
+	for (int w = 0; w < workers; ++w) {
+		if (wpids[w] >= 0) continue;
+		if (restart[w] <= now) {
+			if ((wpids[w] = spawnworker(w)) >= 0) {
+				started[w] = now;
+				continue;
+			}
+			ioerr("fork");
+			restart[w] = now + 1;
+		}
+		if (next == 0 || restart[w] < next) next = restart[w];
+	}
+	return next == 0 ? -1 : next - now;
+}
+
+/* Default concurrency model: A pool of long-lived worker processes
+ * that each serve many connections through an event loop.
+ * The master process only restarts workers that have died,
+ * keeps the recipient index up to date and serves the metrics. */
+static void evworkers(void)
+{
+	time_t started[MAX_WORKERS], restart[MAX_WORKERS];
+	int due = -1;
+	sigset_t sigs, orig;
+	/* SIGCHLD and SIGUSR1 may only interrupt ppoll(), so none goes unnoticed. */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigaddset(&sigs, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sigs, &orig);
+	struct sigaction sa = { .sa_handler = nothing };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	for (int w = 0; w < workers; ++w) {
+		if ((wpids[w] = spawnworker(w)) < 0) die("fork:");
+		started[w] = time(NULL);
+	}
+	handlesignals(stopworkers);
+	/* A client of the stats socket that hangs up is no reason to stop. */
+	signal(SIGPIPE, SIG_IGN);
+	for (;;) {
+		struct pollfd pfd[2] = {
+			{ .fd = idxfd, .events = POLLIN },
+			{ .fd = statfd, .events = POLLIN },
+		};
+		struct timespec timeout = { .tv_sec = due };
+		if (ppoll(pfd, 2, due < 0 ? NULL : &timeout, &orig) < 0) {
+			if (errno != EINTR) die("ppoll:");
+			pfd[0].revents = pfd[1].revents = 0;
+		}
+		dumpstats();
+		if (pfd[0].revents & POLLIN) idxupdate();
+		if (pfd[1].revents & POLLIN) statserve(statfd);
+		int status;
+		pid_t pid;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			reap(pid, status, started, restart);
+		}
+		due = respawn(started, restart);
+	}
+}
+
+int main()
+{
+	const char *conf[NUM_CF_FIELDS];
+	struct tls_config *tlscfg;
+
 	/* Loading the config file. */
 	loadconf(conf, findconf());
 	if ((tlscfg = conftls(conf)) != NULL) {
@@ -97,38 +370,85 @@ int main()
 	if (strlen(conf[CF_DOMAIN]) > sizeof(my_domain))
 		die("Domain name is too long.");
 	strcpy(my_domain, conf[CF_DOMAIN]);
+	splice_data = yesno(conf[CF_SPLICE_DATA]);
+	tracing = yesno(conf[CF_TRACE]);
+	if (strcmp(conf[CF_DURABILITY], "none") == 0) durability = DUR_NONE;
+	else if (strcmp(conf[CF_DURABILITY], "message") == 0) durability = DUR_MESSAGE;
+	else if (strcmp(conf[CF_DURABILITY], "group") == 0) durability = DUR_GROUP;
+	else die("durability must be either none, message or group.");
+	queue_shards = confnum(conf[CF_QUEUE_SHARDS]);
+	if (queue_shards < 1 || queue_shards > MAX_SHARDS)
+		die("queue_shards must be between 1 and %d.", MAX_SHARDS);
+	/* bq1 and bq2 name the formats that replaced them. */
+	const char *ef = conf[CF_ENVELOPE_FORMAT];
+	if (strcmp(ef, "bq3") == 0 || strcmp(ef, "bq1") == 0) envelope_format = ENV_BQ3;
+	else if (strcmp(ef, "bq4") == 0 || strcmp(ef, "bq2") == 0) envelope_format = ENV_BQ4;
+	else die("envelope_format must be either bq3 or bq4.");
+	int maxboxes = confnum(conf[CF_MAX_MAILBOXES]);
+	/* The ports to listen on are separated by spaces. */
+	char *portlist = strdup(conf[CF_PORTS]);
+	if (portlist == NULL) die("strdup:");
+	int nports = 0;
+	for (char *p = strtok(portlist, " "); p != NULL; p = strtok(NULL, " ")) {
+		if (nports == MAX_PORTS) die("Too many ports.");
+		ports[nports++] = p;
+	}
+	if (nports == 0) die("ports must list at least one port.");
+	if ((backlog = confnum(conf[CF_BACKLOG])) < 1) die("backlog must be at least 1.");
+	defer_accept = confnum(conf[CF_DEFER_ACCEPT]);
+	fastopen = confnum(conf[CF_FASTOPEN]);
+	max_sessions = confnum(conf[CF_MAX_SESSIONS]);
+	max_sock_sessions = confnum(conf[CF_MAX_LISTENER_SESSIONS]);
+	peerlimits[PEER_IP].sessions = confnum(conf[CF_MAX_IP_SESSIONS]);
+	peerlimits[PEER_NET].sessions = confnum(conf[CF_MAX_NET_SESSIONS]);
+	peerlimits[PEER_IP].rate = confnum(conf[CF_IP_RATE]);
+	peerlimits[PEER_NET].rate = confnum(conf[CF_NET_RATE]);
+	peerlimits[PEER_IP].burst = confnum(conf[CF_IP_BURST]);
+	peerlimits[PEER_NET].burst = confnum(conf[CF_NET_BURST]);
+	for (int k = 0; k < NUM_PEER_KINDS; ++k) {
+		if (peerlimits[k].burst < 1) die("ip_burst and net_burst must be at least 1.");
+	}
+	int evmode = 0;
+	if (strcmp(conf[CF_MODE], "event") == 0) evmode = 1;
+	else if (strcmp(conf[CF_MODE], "fork") != 0) die("mode must be either event or fork.");
+	/* Default to one worker per CPU we may run on. */
+	cpu_set_t cpus;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0) die("sched_getaffinity:");
+	if ((workers = confnum(conf[CF_WORKERS])) == 0) workers = CPU_COUNT(&cpus);
+	if (!evmode) workers = 1;
+	if (workers > MAX_WORKERS) die("Too many workers.");
+	if ((socks = calloc(workers, sizeof(socks[0]))) == NULL) die("calloc:");
+	if ((wpids = calloc(workers, sizeof(wpids[0]))) == NULL) die("calloc:");
+	if ((wcpus = calloc(workers, sizeof(wcpus[0]))) == NULL) die("calloc:");
+	/* Optionally pin the workers round-robin to the available CPUs. */
+	int pin = evmode && yesno(conf[CF_PIN_WORKERS]);
+	int cpulist[CPU_SETSIZE], ncpus = 0;
+	for (int c = 0; c < CPU_SETSIZE; ++c) {
+		if (CPU_ISSET(c, &cpus)) cpulist[ncpus++] = c;
+	}
+	for (int w = 0; w < workers; ++w) {
+		wcpus[w] = pin ? cpulist[w % ncpus] : -1;
+	}
+	/* Open the listening sockets while we still have the privileges to. */
+	for (int w = 0; w < workers; ++w) {
+		nsocks = openlisteners(socks[w], evmode, wcpus[w]);
+	}
 	dropprivs(conf);
+	/* Relative to the spool, as we are chrooted into it now. */
+	if (conf[CF_STATS_SOCKET][0] != '\0') statfd = statlisten(conf[CF_STATS_SOCKET]);
 	freeconf(conf);
+	mkshards(queue_shards);
+	idxinit(maxboxes);
+	idxfd = idxwatch();
+	statinit();
+	loadinit(workers);
+	peerinit(workers);
 	/* General process configuration. */
 	setpgid(0, 0);
-	reapchildren();
 	handlesignals(teardown);
-	for (;;) {
-		if (poll(pfds, nsocks, -1) < 0) {
-			ioerr("poll");
-			continue;
-		}
-		for (int i = 0; i < nsocks; ++i) {
-			if (!(pfds[i].revents & POLLIN)) continue;
-			int s = accept(socks[i], NULL, NULL);
-			if (s < 0) {
-				ioerr("accept");
-				continue;
-			}
-			pid_t pid = fork();
-			if (pid < 0) {
-				ioerr("fork");
-			} else if (pid == 0) {
-				cnsock = s;
-				if (tlssrv != NULL) {
-					tls_accept_socket(tlssrv, &cntls, cnsock); /* TODO error checkng */
-				}
-				cread = cread_plain;
-				cwrite = cwrite_plain;
-				recvmail();
-			}
-			close(s);
-		}
-	}
+	struct sigaction sa = { .sa_handler = askstats };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	if (evmode) evworkers();
+	else forkloop();
 }
-
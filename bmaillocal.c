@@ -0,0 +1,397 @@
+/* See LICENSE file for copyright and license details. */
+
+/* The local delivery agent. It takes the messages for the local domain out of
+ * the queue and delivers them into the maildirs of their recipients, as
+ * <local>/new/<unique name>. Every recipient gets a hard link to the queued
+ * body, so a message costs one write however many local recipients it has.
+ *
+ * The master process learns about queued envelopes from qready() as soon as
+ * they are published, and hands out one job per recipient to a pool of
+ * workers, picking the worker by a hash of the recipient. So each mailbox is
+ * only ever written by one worker, which delivers in the order that the
+ * master found the messages. Once all recipients of a message are done, the
+ * master takes it out of the queue. Deferred deliveries are tried again a
+ * minute later. A worker that dies is restarted, and gets the jobs again
+ * that it hadn't reported back on. */
+
+#define _GNU_SOURCE /* for ppoll() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "conf.h"
+#include "smtp.h"
+#include "mbox.h"
+#include "queue.h"
+#include "env.h"
+#include "qrun.h"
+
+#define MAX_WORKERS 64
+/* Messages that are being delivered at the same time. */
+#define MAX_INFLIGHT 256
+/* Jobs that a worker may have outstanding. They all have to fit into its pipe,
+ * so that the master never blocks handing them out. That takes about 14 KiB,
+ * which is less than any pipe holds by default. */
+#define WORKER_JOBS 128
+/* How long deferred deliveries wait before they are tried again, in ms. */
+#define RETRY_INTERVAL 60000
+
+/* From the master to a worker. */
+struct job
+{
+	int slot;
+	char name[QNAME_LEN+1];
+	char local[LOCAL_LEN+1];
+};
+
+/* From a worker back to the master. */
+struct result
+{
+	int slot;
+	/* 0 on success, or what went wrong */
+	int err;
+	char local[LOCAL_LEN+1];
+};
+
+struct message
+{
+	int used;
+	char name[QNAME_LEN+1];
+	struct envelope env;
+	/* The next recipient that needs a job, or NULL once all have one. */
+	const char *next;
+	int pending;
+	/* Recipients that failed for now, and will be tried again later. */
+	char **retry;
+	int nretry;
+};
+
+static char my_domain[256];
+static int nshards;
+static int workers;
+static pid_t pids[MAX_WORKERS];
+static int jobfds[MAX_WORKERS];
+/* Both ends of the pipe that all workers report back through. */
+static int resultfd, resultwr;
+/* The jobs that each worker hasn't reported back on, in the order it got them. */
+static struct job jobs[MAX_WORKERS][WORKER_JOBS];
+static int jobhead[MAX_WORKERS];
+static int outstanding[MAX_WORKERS];
+/* How many of them fit into the pipe of each worker. */
+static int joblimit[MAX_WORKERS];
+/* When to look through the queue for deferred deliveries, or 0. */
+static long retry;
+
+static struct message msgs[MAX_INFLIGHT];
+static int nused;
+/* Slots of the messages that still have recipients to hand out,
+ * in the order the messages were found. */
+static int order[MAX_INFLIGHT];
+static int ohead, olen;
+
+/* Monotonic time in ms. */
+static long now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void mkmaildir(const char *local)
+{
+	static const char *dirs[] = { "tmp", "new", "cur" };
+	char path[LOCAL_LEN+5];
+	for (int d = 0; d < 3; ++d) {
+		sprintf(path, "%s/%s", local, dirs[d]);
+		mkdir(path, 0700);
+	}
+}
+
+/* Links the body of the queued message name into the maildir of local.
+ * Returns 0 or an errno value. */
+static int deliver(const char *name, const char *local)
+{
+	char from[QPATH_LEN], to[MAILPATH_LEN+1], id[UNIQNAME_LEN+1];
+	if (!vrfylocal(local)) return ENOENT;
+	sprintf(from, ".queue/msg/%s", name);
+	uniqname(id);
+	sprintf(to, "%s/new/%s", local, id);
+	if (link(from, to) == 0) return 0;
+	if (errno != ENOENT) return errno;
+	/* Maybe the maildir isn't set up yet. */
+	mkmaildir(local);
+	return link(from, to) == 0 ? 0 : errno;
+}
+
+static void worker(int in, int out)
+{
+	struct job job;
+	struct result res;
+	memset(&res, 0, sizeof(res));
+	while (read(in, &job, sizeof(job)) == sizeof(job)) {
+		res.slot = job.slot;
+		res.err = deliver(job.name, job.local);
+		strcpy(res.local, job.local);
+		if (write(out, &res, sizeof(res)) != sizeof(res)) die("write:");
+	}
+	exit(0);
+}
+
+static void spawnworker(int w)
+{
+	int fds[2];
+	if (pipe(fds) < 0) die("pipe:");
+	/* A pipe may be down to one page once the user has many of them. */
+	int size = fcntl(fds[1], F_GETPIPE_SZ);
+	if (size >= 0 && (size_t) size < WORKER_JOBS * sizeof(struct job)) {
+		int grown = fcntl(fds[1], F_SETPIPE_SZ, WORKER_JOBS * sizeof(struct job));
+		if (grown >= 0) size = grown;
+	}
+	if (size < 0) die("fcntl:");
+	joblimit[w] = size / sizeof(struct job);
+	if (joblimit[w] > WORKER_JOBS) joblimit[w] = WORKER_JOBS;
+	if ((pids[w] = fork()) < 0) die("fork:");
+	if (pids[w] == 0) {
+		for (int o = 0; o < workers; ++o) {
+			if (o != w && pids[o] > 0) close(jobfds[o]);
+		}
+		close(fds[1]);
+		close(resultfd);
+		signal(SIGPIPE, SIG_DFL);
+		worker(fds[0], resultwr);
+	}
+	close(fds[0]);
+	jobfds[w] = fds[1];
+}
+
+static void spawnworkers(void)
+{
+	int results[2];
+	if (pipe(results) < 0) die("pipe:");
+	resultfd = results[0];
+	/* Kept open for the workers that have to be restarted. */
+	resultwr = results[1];
+	for (int w = 0; w < workers; ++w) spawnworker(w);
+}
+
+/* Hands a job to worker w, and remembers it until the worker reports back.
+ * Returns 0 if the worker is gone. */
+static int give(int w, const struct job *job)
+{
+	if (write(jobfds[w], job, sizeof(*job)) != sizeof(*job)) {
+		if (errno != EPIPE) die("write:");
+		return 0;
+	}
+	jobs[w][(jobhead[w] + outstanding[w]) % WORKER_JOBS] = *job;
+	++outstanding[w];
+	return 1;
+}
+
+static void finish(struct message *m);
+
+static int inflight(const char *name)
+{
+	for (int s = 0; s < MAX_INFLIGHT; ++s) {
+		if (msgs[s].used && strcmp(msgs[s].name, name) == 0) return 1;
+	}
+	return 0;
+}
+
+/* Takes the message on for delivery if it is for the local domain.
+ * Returns 0 if it has to wait. */
+static int take(const char *name)
+{
+	char path[QPATH_LEN];
+	struct envelope env;
+	if (nused == MAX_INFLIGHT) return 0;
+	if (inflight(name)) return 1;
+	sprintf(path, ".queue/env/%s", name);
+	errno = 0;
+	if (!envload(&env, path)) {
+		/* It may just have been taken out of the queue. */
+		if (errno != ENOENT) fprintf(stderr, "! Damaged envelope %s\n", name);
+		return 1;
+	}
+	if (strcasecmp(env.domain, my_domain) != 0) {
+		envfree(&env);
+		return 1;
+	}
+	if (env.nrcpts == 0) {
+		/* Nothing to deliver. */
+		qdone(name);
+		envfree(&env);
+		return 1;
+	}
+	int s = 0;
+	while (msgs[s].used) ++s;
+	struct message *m = &msgs[s];
+	memset(m, 0, sizeof(*m));
+	m->used = 1;
+	strcpy(m->name, name);
+	m->env = env;
+	m->next = envrcpt(&m->env);
+	if ((m->retry = calloc(env.nrcpts, sizeof(m->retry[0]))) == NULL) die("calloc:");
+	++nused;
+	if (m->next == NULL) finish(m);
+	else order[(ohead + olen++) % MAX_INFLIGHT] = s;
+	return 1;
+}
+
+/* Hands out jobs, in the order the messages were found. Stops as soon as a
+ * recipient's worker is busy, so no later message can overtake it there. */
+static void dispatch(void)
+{
+	struct job job;
+	memset(&job, 0, sizeof(job));
+	while (olen > 0) {
+		int s = order[ohead];
+		struct message *m = &msgs[s];
+		while (m->next != NULL) {
+			int w = fnv1a(m->next) % workers;
+			if (outstanding[w] >= joblimit[w]) return;
+			job.slot = s;
+			strcpy(job.name, m->name);
+			snprintf(job.local, sizeof(job.local), "%s", m->next);
+			/* A dead worker gets the job once it has been restarted. */
+			if (!give(w, &job)) return;
+			++m->pending;
+			m->next = envrcpt(&m->env);
+		}
+		ohead = (ohead + 1) % MAX_INFLIGHT;
+		--olen;
+	}
+}
+
+static void finish(struct message *m)
+{
+	if (m->nretry > 0) {
+		if (!qdefer(m->name, &m->env, (const char **) m->retry, m->nretry)) ioerr("qdefer");
+	} else {
+		qdone(m->name);
+	}
+	for (int i = 0; i < m->nretry; ++i) free(m->retry[i]);
+	free(m->retry);
+	envfree(&m->env);
+	m->used = 0;
+	--nused;
+}
+
+static void collect(void)
+{
+	struct result res;
+	ssize_t n;
+	while ((n = read(resultfd, &res, sizeof(res))) == sizeof(res)) {
+		struct message *m = &msgs[res.slot];
+		int w = fnv1a(res.local) % workers;
+		jobhead[w] = (jobhead[w] + 1) % WORKER_JOBS;
+		--outstanding[w];
+		--m->pending;
+		switch (res.err) {
+		case 0:
+			break;
+		case ENOENT: case ENOTDIR: case EINVAL:
+			/* There is no such mailbox, and nobody to tell about it. */
+			fprintf(stderr, "! %s: No mailbox for %s\n", m->name, res.local);
+			break;
+		default:
+			fprintf(stderr, "! %s: Delivery to %s deferred: %s\n",
+				m->name, res.local, strerror(res.err));
+			if ((m->retry[m->nretry++] = strdup(res.local)) == NULL) die("strdup:");
+			if (retry == 0) retry = now() + RETRY_INTERVAL;
+			break;
+		}
+		if (m->pending == 0 && m->next == NULL) finish(m);
+		/* Don't wait for more results if the pipe is empty. */
+		struct pollfd pfd = { .fd = resultfd, .events = POLLIN };
+		if (poll(&pfd, 1, 0) <= 0) return;
+	}
+	if (n < 0) ioerr("read");
+}
+
+/* Restarts the workers that have died, and gives them their jobs again.
+ * A delivery may then be made twice, but never lost. */
+static void reap(void)
+{
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		int w = 0;
+		while (w < workers && pids[w] != pid) ++w;
+		if (w == workers) continue;
+		fprintf(stderr, "! Delivery worker %d exited with status %d, restarting.\n", w, status);
+		/* Take in what it did report back before it died. */
+		struct pollfd pfd = { .fd = resultfd, .events = POLLIN };
+		if (poll(&pfd, 1, 0) > 0) collect();
+		close(jobfds[w]);
+		spawnworker(w);
+		for (int j = 0; j < outstanding[w]; ++j) {
+			const struct job *job = &jobs[w][(jobhead[w] + j) % WORKER_JOBS];
+			if (write(jobfds[w], job, sizeof(*job)) != sizeof(*job)) die("write:");
+		}
+	}
+}
+
+static void nothing(int sig)
+{
+	(void) sig;
+}
+
+int main()
+{
+	const char *conf[NUM_CF_FIELDS];
+	loadconf(conf, findconf());
+	if (strlen(conf[CF_DOMAIN]) >= sizeof(my_domain))
+		die("Domain name is too long.");
+	strcpy(my_domain, conf[CF_DOMAIN]);
+	nshards = confnum(conf[CF_QUEUE_SHARDS]);
+	if (nshards < 1 || nshards > MAX_SHARDS)
+		die("queue_shards must be between 1 and %d.", MAX_SHARDS);
+	if ((workers = confnum(conf[CF_DELIVERY_WORKERS])) == 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1) workers = 1;
+	if (workers > MAX_WORKERS) die("Too many delivery workers.");
+	dropprivs(conf);
+	freeconf(conf);
+	mkshards(nshards);
+	/* Dead workers are noticed by their pipes breaking, and by SIGCHLD,
+	 * which may only interrupt ppoll() so that none goes unnoticed. */
+	signal(SIGPIPE, SIG_IGN);
+	sigset_t sigs, orig;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigs, &orig);
+	struct sigaction sa = { .sa_handler = nothing };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	spawnworkers();
+	struct pollfd pfds[2] = {
+		{ .fd = resultfd, .events = POLLIN },
+		{ .fd = qwatch(), .events = POLLIN },
+	};
+	for (;;) {
+		reap();
+		if (retry != 0 && now() >= retry) {
+			qrescan();
+			retry = 0;
+		}
+		qready(take);
+		dispatch();
+		long timeout = -1;
+		if (retry != 0) timeout = retry > now() ? retry - now() : 0;
+		struct timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = timeout % 1000 * 1000000 };
+		int r = ppoll(pfds, 2, timeout < 0 ? NULL : &ts, &orig);
+		if (r < 0 && errno != EINTR) die("ppoll:");
+		if (r > 0 && (pfds[0].revents & POLLIN)) collect();
+	}
+}
@@ -0,0 +1,512 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Microbenchmarks for the functions that every byte or every command of a
+ * session goes through. They run in-process on a built-in corpus, with the
+ * connection reading from memory instead of a socket, and report ns per
+ * operation and, on x86, TSC cycles per byte. Pass a substring of benchmark
+ * names to run only those. Before anything is timed, the results of the
+ * functions are checked against plain scalar versions, so that a broken fast
+ * path can't go unnoticed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define HAVE_TSC
+#endif
+
+#include <tls.h>
+
+#include "conn.h"
+#include "smtp.h"
+#include "mbox.h"
+#include "util.h"
+
+/* How long each benchmark runs for, in ns. */
+#define RUN_TIME 200000000.0
+#define BODY_LEN (4 << 20)
+
+static const char *commands[] = {
+	"EHLO mail-ed1-f54.google.com\r\n",
+	"MAIL FROM:<john.smith-jr@mail.example-company.com> BODY=8BITMIME\r\n",
+	"RCPT TO:<alice@example.org>\r\n",
+	"RCPT TO:<newsletter+bounce.12345678@lists.some-long-domain-name.example.net>\r\n",
+	"RCPT TO:<b.o.b@[192.168.100.200]>\r\n",
+	"DATA\r\n",
+	"BDAT 65536 LAST\r\n",
+	"NOOP\r\n",
+	"RSET\r\n",
+	"QUIT\r\n",
+};
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+/* What pverb() has to make of each of the commands. */
+static const int verbs[NUM_COMMANDS] = {
+	VERB_EHLO,
+	VERB_MAIL,
+	VERB_RCPT,
+	VERB_RCPT,
+	VERB_RCPT,
+	VERB_DATA,
+	VERB_BDAT,
+	VERB_NOOP,
+	VERB_RSET,
+	VERB_QUIT,
+};
+
+/* The part of the RCPT commands behind "RCPT TO:<". */
+static const char *mailboxes[] = {
+	"alice@example.org>\r\n",
+	"john.smith-jr@mail.example-company.com>\r\n",
+	"newsletter+bounce.12345678@lists.some-long-domain-name.example.net>\r\n",
+	"b.o.b@[192.168.100.200]>\r\n",
+};
+#define NUM_MAILBOXES (sizeof(mailboxes) / sizeof(mailboxes[0]))
+static size_t mailboxlens[NUM_MAILBOXES];
+
+/* The parts of each mailbox that plocal() and pdomain() have to find. */
+static const char *parts[NUM_MAILBOXES][2] = {
+	{ "alice", "example.org" },
+	{ "john.smith-jr", "mail.example-company.com" },
+	{ "newsletter+bounce.12345678", "lists.some-long-domain-name.example.net" },
+	{ "b.o.b", "[192.168.100.200]" },
+};
+
+enum {
+	BODY_ATTACHMENT, /* Base64 in 76 character lines. */
+	BODY_SHORT,      /* Lines of 0 to 20 characters. */
+	BODY_DOTTED,     /* Every other line is dot-stuffed. */
+	NUM_BODIES
+};
+
+static char *bodies[NUM_BODIES];
+static size_t bodylens[NUM_BODIES];
+/* Many command lines in a row, as a client that pipelines would send them. */
+static char *script;
+static size_t scriptlen;
+static size_t scriptpos;
+
+static volatile unsigned long sink;
+static unsigned long seed = 1;
+
+static unsigned long rnd(void)
+{
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return seed >> 33;
+}
+
+static void makebody(int b)
+{
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char *body = malloc(BODY_LEN + 128);
+	size_t len = 0;
+	for (int line = 0; len < BODY_LEN; ++line) {
+		size_t n = 76;
+		if (b == BODY_SHORT) n = rnd() % 21;
+		if (b == BODY_DOTTED) n = rnd() % 80;
+		int dotted = b == BODY_DOTTED && line % 2 == 0;
+		/* A lone dot would end the body. */
+		if (dotted && n < 2) n = 2;
+		for (size_t i = 0; i < n; ++i) body[len + i] = b64[rnd() % 64];
+		if (dotted) body[len] = '.';
+		len += n;
+		body[len++] = '\r', body[len++] = '\n';
+	}
+	memcpy(body + len, ".\r\n", 3);
+	bodies[b] = body;
+	bodylens[b] = len + 3;
+}
+
+static void makecorpus(void)
+{
+	for (int b = 0; b < NUM_BODIES; ++b) makebody(b);
+	for (size_t m = 0; m < NUM_MAILBOXES; ++m) mailboxlens[m] = strlen(mailboxes[m]);
+	scriptlen = 0;
+	script = malloc(BODY_LEN + 256);
+	while (scriptlen < BODY_LEN) {
+		const char *c = commands[rnd() % NUM_COMMANDS];
+		size_t n = strlen(c);
+		memcpy(script + scriptlen, c, n);
+		scriptlen += n;
+	}
+}
+
+/* Stands in for the socket: hands out the command script over and over. */
+static int memread(char *buf, int max)
+{
+	size_t n = scriptlen - scriptpos;
+	if (n > (size_t) max) n = max;
+	memcpy(buf, script + scriptpos, n);
+	scriptpos += n;
+	if (scriptpos == scriptlen) scriptpos = 0;
+	return n;
+}
+
+static int memwrite(char *buf, int max)
+{
+	(void) buf;
+	return max;
+}
+
+static double nsnow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long ticks(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Each benchmark does its work iters times, and returns how many bytes
+ * of input that covered. */
+
+static size_t bverb(long iters)
+{
+	size_t bytes = 0;
+	for (long i = 0; i < iters; ++i) {
+		const char *c = commands[i % NUM_COMMANDS];
+		int len = strlen(c);
+		cphead = (char *) c;
+		sink += pverb(len);
+		bytes += cphead - c;
+	}
+	return bytes;
+}
+
+static size_t bword(long iters)
+{
+	for (long i = 0; i < iters; ++i) {
+		cphead = (char *) commands[3];
+		sink += pword("RCPT") && pchar(' ') && pword("TO:<");
+	}
+	return iters * 9;
+}
+
+static size_t blocal(long iters)
+{
+	char local[LOCAL_LEN+1];
+	size_t bytes = 0;
+	for (long i = 0; i < iters; ++i) {
+		cphead = (char *) mailboxes[i % NUM_MAILBOXES];
+		cpend = cphead + mailboxlens[i % NUM_MAILBOXES];
+		char *start = cphead;
+		sink += plocal(local);
+		bytes += cphead - start;
+	}
+	return bytes;
+}
+
+static size_t bdomain(long iters)
+{
+	char domain[DOMAIN_LEN+1];
+	size_t bytes = 0;
+	for (long i = 0; i < iters; ++i) {
+		cphead = strchr(mailboxes[i % NUM_MAILBOXES], '@') + 1;
+		cpend = (char *) mailboxes[i % NUM_MAILBOXES] + mailboxlens[i % NUM_MAILBOXES];
+		char *start = cphead;
+		sink += pdomain(domain);
+		bytes += cphead - start;
+	}
+	return bytes;
+}
+
+static size_t bmailbox(long iters)
+{
+	char local[LOCAL_LEN+1], domain[DOMAIN_LEN+1];
+	size_t bytes = 0;
+	for (long i = 0; i < iters; ++i) {
+		cphead = (char *) mailboxes[i % NUM_MAILBOXES];
+		cpend = cphead + mailboxlens[i % NUM_MAILBOXES];
+		char *start = cphead;
+		sink += pmailbox(local, domain);
+		bytes += cphead - start;
+	}
+	return bytes;
+}
+
+/* Walks a body the way acdata() does, from one dotted line to the next. */
+static size_t bscan(int b, long iters)
+{
+	const char *end = bodies[b] + bodylens[b];
+	for (long i = 0; i < iters; ++i) {
+		const char *p = bodies[b];
+		while ((p = dotscan(p, end)) != NULL) {
+			++sink;
+			p += 3;
+		}
+	}
+	return iters * bodylens[b];
+}
+
+static size_t bscanattach(long iters)
+{
+	return bscan(BODY_ATTACHMENT, iters);
+}
+
+static size_t bscanshort(long iters)
+{
+	return bscan(BODY_SHORT, iters);
+}
+
+static size_t bscandotted(long iters)
+{
+	return bscan(BODY_DOTTED, iters);
+}
+
+static size_t breadln(long iters)
+{
+	static struct conn conn;
+	char *line;
+	size_t bytes = 0;
+	cn = &conn;
+	cn->read = memread;
+	cn->write = memwrite;
+	for (long i = 0; i < iters; ++i) {
+		if (creadln(&line, COMMAND_LEN) < 1) abort();
+		bytes += cn->in + cn->inhead - line;
+		sink += line[0];
+	}
+	return bytes;
+}
+
+static size_t buniqname(long iters)
+{
+	char name[UNIQNAME_LEN+1];
+	for (long i = 0; i < iters; ++i) {
+		uniqname(name);
+		sink += name[0];
+	}
+	return 0;
+}
+
+/* The checks die on the first result that differs from the scalar version. */
+
+/* Finds CR LF . the slow way. */
+static const char *naivescan(const char *p, const char *end)
+{
+	for (; end - p >= 3; ++p) {
+		if (p[0] == '\r' && p[1] == '\n' && p[2] == '.') return p;
+	}
+	return NULL;
+}
+
+static void checkscan(void)
+{
+	for (int b = 0; b < NUM_BODIES; ++b) {
+		const char *end = bodies[b] + bodylens[b];
+		/* All the way through, as acdata() does. */
+		const char *p = bodies[b], *q = bodies[b];
+		do {
+			p = dotscan(p, end);
+			q = naivescan(q, end);
+			if (p != q) die("dotscan() is wrong on body %d at offset %ld.", b, (long) (q - bodies[b]));
+			if (p != NULL) p += 3, q += 3;
+		} while (p != NULL);
+		/* And on short ranges at every alignment, for the tail handling. */
+		for (int i = 0; i < 4096; ++i) {
+			p = bodies[b] + rnd() % (bodylens[b] - 128);
+			const char *e = p + rnd() % 128;
+			if (dotscan(p, e) != naivescan(p, e))
+				die("dotscan() is wrong on body %d in [%ld, %ld).",
+					b, (long) (p - bodies[b]), (long) (e - bodies[b]));
+		}
+	}
+}
+
+/* Removes the dot-stuffing from body b with dotscan(), as acdata() does. */
+static size_t unstuff(int b, char *out)
+{
+	const char *p = bodies[b], *end = p + bodylens[b];
+	size_t n = 0;
+	for (;;) {
+		/* p is at the beginning of a line. */
+		if (*p == '.') {
+			if (p[1] == '\r' && p[2] == '\n') break;
+			++p;
+		}
+		const char *crlf = dotscan(p, end);
+		const char *stop = crlf != NULL ? crlf + 2 : end;
+		memcpy(out + n, p, stop - p);
+		n += stop - p;
+		if ((p = stop) == end) break;
+	}
+	return n;
+}
+
+/* The same, a line at a time. */
+static size_t naiveunstuff(int b, char *out)
+{
+	const char *p = bodies[b], *end = p + bodylens[b];
+	size_t n = 0;
+	while (p < end) {
+		const char *lf = memchr(p, '\n', end - p);
+		if (lf == NULL) lf = end - 1;
+		size_t len = lf + 1 - p;
+		if (len == 3 && p[0] == '.') break;
+		if (p[0] == '.') ++p, --len;
+		memcpy(out + n, p, len);
+		n += len;
+		p = lf + 1;
+	}
+	return n;
+}
+
+static void checkunstuff(void)
+{
+	char *got = malloc(BODY_LEN + 128), *want = malloc(BODY_LEN + 128);
+	if (got == NULL || want == NULL) die("malloc:");
+	for (int b = 0; b < NUM_BODIES; ++b) {
+		size_t n = unstuff(b, got), m = naiveunstuff(b, want);
+		if (n != m || memcmp(got, want, n) != 0) die("Unstuffing body %d goes wrong.", b);
+	}
+	free(got);
+	free(want);
+}
+
+static void checkverb(void)
+{
+	char line[COMMAND_LEN+1];
+	for (size_t c = 0; c < NUM_COMMANDS; ++c) {
+		int len = strlen(commands[c]);
+		for (int lower = 0; lower < 2; ++lower) {
+			for (int i = 0; i <= len; ++i) line[i] = lower ? tolower(commands[c][i]) : commands[c][i];
+			cphead = line;
+			if (pverb(len) != verbs[c]) die("pverb() misreads %s", commands[c]);
+			/* Too short for any verb. */
+			cphead = line;
+			if (pverb(3) != VERB_UNKNOWN || cphead != line) die("pverb() reads past the line.");
+		}
+	}
+	static const struct { const char *line; int verb; } odd[] = {
+		{ "STARTTLS\r\n", VERB_STARTTLS },
+		{ "starttls\r\n", VERB_STARTTLS },
+		{ "STARTTLX\r\n", VERB_UNKNOWN },
+		{ "STAR\r\n", VERB_UNKNOWN },
+		{ "HELX a\r\n", VERB_UNKNOWN },
+		{ "H@LO a\r\n", VERB_UNKNOWN },
+	};
+	for (size_t i = 0; i < sizeof(odd) / sizeof(odd[0]); ++i) {
+		cphead = (char *) odd[i].line;
+		if (pverb(strlen(odd[i].line)) != odd[i].verb) die("pverb() misreads %s", odd[i].line);
+	}
+}
+
+/* Checks what plocal() or pdomain() find at p, in a line that ends at end,
+ * against the character class. */
+static void checkpart(char *p, char *end, int domain)
+{
+	char str[DOMAIN_LEN+1];
+	size_t n = 0, max = domain ? DOMAIN_LEN : LOCAL_LEN;
+	while (p + n < end && (domain ? isdomainc(p[n]) : islocalc(p[n]))) ++n;
+	cphead = p;
+	cpend = end;
+	int ok = domain ? pdomain(str) : plocal(str);
+	if (ok != (n > 0 && n <= max) || (ok && (cphead != p + n || memcmp(str, p, n) != 0)))
+		die("%s() finds the wrong run in %.*s", domain ? "pdomain" : "plocal", (int) n + 1, p);
+}
+
+static void checkspan(void)
+{
+	char local[LOCAL_LEN+1], domain[DOMAIN_LEN+1];
+	for (size_t m = 0; m < NUM_MAILBOXES; ++m) {
+		cphead = (char *) mailboxes[m];
+		cpend = cphead + mailboxlens[m];
+		if (!pmailbox(local, domain) || strcmp(local, parts[m][0]) != 0 || strcmp(domain, parts[m][1]) != 0)
+			die("pmailbox() misreads %s", mailboxes[m]);
+	}
+	/* Random runs that end at every offset around a page boundary, in lines
+	 * that end anywhere from right there to a little later, so that the
+	 * vector loop has to hand over to the table at every offset. */
+	static const char chars[] = "abcXYZ019.-+_!#~@[] \r\n\x80";
+	char *page;
+	if ((errno = posix_memalign((void **) &page, 4096, 3 * 4096)) != 0) die("posix_memalign:");
+	for (int i = 0; i < 3 * 4096; ++i) page[i] = 'a';
+	for (int off = 4096 - 80; off < 4096 + 80; ++off) {
+		for (int t = 0; t < 16; ++t) {
+			char *p = page + off - rnd() % 70;
+			for (char *c = p; c < page + off; ++c) c[0] = chars[rnd() % 9];
+			for (int c = 0; c < 8; ++c) page[off + c] = chars[rnd() % (sizeof(chars) - 1)];
+			char *end = page + off + rnd() % 9;
+			checkpart(p, end, 0);
+			checkpart(p, end, 1);
+		}
+	}
+	free(page);
+}
+
+static void check(void)
+{
+	checkscan();
+	checkunstuff();
+	checkverb();
+	checkspan();
+}
+
+static const struct {
+	const char *name;
+	size_t (*run)(long iters);
+} benchmarks[] = {
+	{ "pverb", bverb },
+	{ "pword", bword },
+	{ "plocal", blocal },
+	{ "pdomain", bdomain },
+	{ "pmailbox", bmailbox },
+	{ "dotscan/attachment", bscanattach },
+	{ "dotscan/short", bscanshort },
+	{ "dotscan/dotted", bscandotted },
+	{ "creadln", breadln },
+	{ "uniqname", buniqname },
+};
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void measure(int b)
+{
+	/* Find an iteration count that runs for long enough. */
+	long iters = 1;
+	double ns;
+	for (;;) {
+		double start = nsnow();
+		benchmarks[b].run(iters);
+		ns = nsnow() - start;
+		if (ns > RUN_TIME / 10) break;
+		iters *= 2;
+	}
+	iters = iters * (RUN_TIME / ns);
+	if (iters < 1) iters = 1;
+	double start = nsnow();
+	unsigned long long t0 = ticks();
+	size_t bytes = benchmarks[b].run(iters);
+	unsigned long long t1 = ticks();
+	ns = nsnow() - start;
+	printf("%-20s %12.2f", benchmarks[b].name, ns / iters);
+	if (bytes > 0) {
+		printf(" %12.1f", bytes * 1e3 / ns);
+		if (t1 > t0) printf(" %12.3f", (double) (t1 - t0) / bytes);
+		else printf(" %12s", "-");
+	}
+	putchar('\n');
+}
+
+int main(int argc, char *argv[])
+{
+	makecorpus();
+	check();
+	printf("%-20s %12s %12s %12s\n", "benchmark", "ns/op", "MB/s", "cycles/byte");
+	for (size_t b = 0; b < NUM_BENCHMARKS; ++b) {
+		if (argc > 1 && strstr(benchmarks[b].name, argv[1]) == NULL) continue;
+		measure(b);
+	}
+	return 0;
+}
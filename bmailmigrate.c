@@ -0,0 +1,83 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Moves messages that older versions of bmaild queued directly in .queue/msg
+ * and .queue/env into the shards described in queue.h. This is safe to do
+ * while bmaild is running, but not while anything consumes the queue. */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "conf.h"
+#include "mbox.h"
+#include "queue.h"
+
+static int nshards;
+static int moved, failed;
+
+/* Moves .queue/dir/name into its shard. */
+static int move(const char *dir, const char *name)
+{
+	char from[64+NAME_MAX], to[64+NAME_MAX];
+	sprintf(from, ".queue/%s/%s", dir, name);
+	sprintf(to, ".queue/%s/%02x/%s", dir, qshard(name, nshards), name);
+	if (rename(from, to) < 0) {
+		fprintf(stderr, "! rename %s: %s\n", from, strerror(errno));
+		++failed;
+		return 0;
+	}
+	return 1;
+}
+
+/* Calls fn on every file (but not the shards) directly in .queue/dir. */
+static void walk(const char *dir, void (*fn)(const char *name))
+{
+	char path[64];
+	struct dirent *de;
+	struct stat info;
+	DIR *d;
+	sprintf(path, ".queue/%s", dir);
+	if ((d = opendir(path)) == NULL) die("opendir %s:", path);
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.') continue;
+		if (fstatat(dirfd(d), de->d_name, &info, AT_SYMLINK_NOFOLLOW) < 0) continue;
+		if (S_ISREG(info.st_mode)) fn(de->d_name);
+	}
+	closedir(d);
+}
+
+/* The body has to be in place before the envelope appears. */
+static void moveenv(const char *name)
+{
+	char path[64+NAME_MAX];
+	struct stat info;
+	sprintf(path, ".queue/msg/%s", name);
+	if (stat(path, &info) == 0 && !move("msg", name)) return;
+	if (move("env", name)) ++moved;
+}
+
+/* Whatever is left in msg/ lost its envelope, but keep it anyway. */
+static void movemsg(const char *name)
+{
+	move("msg", name);
+}
+
+int main()
+{
+	const char *conf[NUM_CF_FIELDS];
+	loadconf(conf, findconf());
+	nshards = confnum(conf[CF_QUEUE_SHARDS]);
+	if (nshards < 1 || nshards > MAX_SHARDS)
+		die("queue_shards must be between 1 and %d.", MAX_SHARDS);
+	dropprivs(conf);
+	freeconf(conf);
+	mkshards(nshards);
+	walk("env", moveenv);
+	walk("msg", movemsg);
+	printf("Moved %d queued messages into %d shards.\n", moved, nshards);
+	return failed > 0;
+}
@@ -0,0 +1,758 @@
+/* See LICENSE file for copyright and license details. */
+
+/* The relay. It sends the queued messages for other domains on to the host
+ * named by relay_host, or else to the mail exchangers of the domain, which is
+ * its own if it has no MX records. Since the relay runs chrooted into the
+ * spool, domains are resolved with the etc/resolv.conf in there.
+ *
+ * The master process learns about queued envelopes from qready() as soon as
+ * they are published, and hands each to a link, a process that keeps one SMTP
+ * connection to a destination open. It opens up to relay_connections links
+ * per destination. A link takes one message after the other, starting every
+ * transaction but the first with RSET, and pipelines its commands if the
+ * server allows it. The body goes out of the
+ * queue with sendfile(): as a single BDAT chunk if the server knows CHUNKING,
+ * and after DATA otherwise, with the dots that lines need stuffed in between.
+ * Binary messages need BDAT, so they wait for a server that knows both
+ * CHUNKING and BINARYMIME. Links that stay idle for a while are closed.
+ *
+ * Recipients that the server rejects for good are set aside with qbury(),
+ * since there is no way to bounce messages yet. Links never use STARTTLS:
+ * sendfile() can't go through TLS, so that needs a body path of its own. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include <tls.h>
+
+#include "util.h"
+#include "conf.h"
+#include "conn.h"
+#include "smtp.h"
+#include "mbox.h"
+#include "queue.h"
+#include "env.h"
+#include "qrun.h"
+
+#define MAX_LINKS 64
+#define MAX_DESTS 256
+/* Messages that are being relayed at the same time. */
+#define MAX_INFLIGHT 256
+/* How long a link may stay idle before it is closed, in ms. */
+#define LINK_IDLE 10000
+/* How long a destination is left alone after it failed us, in ms. */
+#define RETRY_INTERVAL 300000
+/* How long to wait for the server, in s. */
+#define REPLY_TIMEOUT 300
+/* Mail exchangers of a domain that are tried. */
+#define MAX_MX 16
+
+/* From the master to a link. */
+struct job
+{
+	int slot;
+	char name[QNAME_LEN+1];
+};
+
+enum {
+	/* Every recipient got the message or was rejected for good. */
+	R_SENT,
+	/* Some recipients have to be tried again later, or the whole message
+	 * if the server can't take it. */
+	R_DEFERRED,
+	/* The connection failed and the message is untouched. The link is gone. */
+	R_FAILED,
+};
+
+/* From a link back to the master. */
+struct result
+{
+	int link;
+	int slot;
+	int status;
+};
+
+struct dest
+{
+	char domain[DOMAIN_LEN+1];
+	int nlinks;
+	int nmsgs;
+	/* When to try again after a failure. */
+	long retry;
+	/* Whether messages for it were left in the queue until then. */
+	int parked;
+};
+
+struct link
+{
+	/* 0 if the slot is free. */
+	pid_t pid;
+	int fd;
+	int dest;
+	/* The message it works on, or -1 while it is idle. */
+	int slot;
+	long idle;
+};
+
+struct message
+{
+	int used;
+	char name[QNAME_LEN+1];
+	int dest;
+};
+
+static char my_domain[256];
+static char relay_host[DOMAIN_LEN+1];
+static char relay_port[16];
+/* The address of relay_host, looked up before the chroot. */
+static struct addrinfo *relay_addr;
+static int maxlinks;
+static int nshards;
+static int resultfds[2];
+static int watchfd;
+
+static struct dest dests[MAX_DESTS];
+static struct link links[MAX_LINKS];
+static struct message msgs[MAX_INFLIGHT];
+static int nused;
+/* Slots of the messages that wait for a link, oldest first. */
+static int order[MAX_INFLIGHT];
+static int ohead, olen;
+/* When to look through the queue again for deferred messages, or -1. */
+static long rerun = -1;
+
+/* State of a link process. */
+static struct conn conn;
+static int pipelining, chunking, eightbit, binarymime;
+/* Whether the connection had a transaction already. */
+static int used;
+/* Replies to the commands of the current transaction. */
+static int *codes;
+static int ncodes, nread;
+
+/* Monotonic time in ms. */
+static long now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int haskw(const char *line, const char *kw)
+{
+	size_t n = strlen(kw);
+	return strncasecmp(line, kw, n) == 0 && (line[n] == '\r' || line[n] == ' ');
+}
+
+/* Reads a complete reply and returns its code, or -1 if the connection broke.
+ * With ehlo set, notes the extensions that the server announces. */
+static int getreply(int ehlo)
+{
+	char *line;
+	int r;
+	for (;;) {
+		if ((r = creadln(&line, REPLY_MAX)) < 0) return -1;
+		if (r == 0) continue;
+		if (line[0] < '2' || line[0] > '5' || line[1] < '0' || line[1] > '9' ||
+		    line[2] < '0' || line[2] > '9') return -1;
+		if (ehlo) {
+			if (haskw(line + 4, "PIPELINING")) pipelining = 1;
+			if (haskw(line + 4, "CHUNKING")) chunking = 1;
+			if (haskw(line + 4, "8BITMIME")) eightbit = 1;
+			if (haskw(line + 4, "BINARYMIME")) binarymime = 1;
+		}
+		if (line[3] != '-') return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+	}
+}
+
+/* Waits for the replies to all commands that were sent.
+ * Returns 0 if the connection broke. */
+static int readreplies(void)
+{
+	while (nread < ncodes) {
+		if ((codes[nread++] = getreply(0)) < 0) return 0;
+	}
+	return 1;
+}
+
+/* Sends a command, or queues it up if the server allows pipelining. */
+static int command(char *cmd)
+{
+	cwritent(cmd);
+	++ncodes;
+	return pipelining || readreplies();
+}
+
+/* Looks up the mail exchangers of domain, most preferred first. A domain
+ * without MX records is its own. Returns how many there are, or 0 if the
+ * lookup failed or the domain takes no mail. */
+static int mxlookup(const char *domain, char hosts[][DOMAIN_LEN+1])
+{
+	unsigned char answer[4096];
+	char host[NS_MAXDNAME];
+	int prefs[MAX_MX], n = 0;
+	ns_msg msg;
+	ns_rr rr;
+	int len = res_query(domain, ns_c_in, ns_t_mx, answer, sizeof(answer));
+	if (len < 0) {
+		if (h_errno != NO_DATA) {
+			fprintf(stderr, "! %s: %s\n", domain, hstrerror(h_errno));
+			return 0;
+		}
+	} else if (ns_initparse(answer, len, &msg) < 0) {
+		fprintf(stderr, "! %s: Bad MX answer\n", domain);
+		return 0;
+	} else {
+		for (int i = 0; i < ns_msg_count(msg, ns_s_an); ++i) {
+			if (ns_parserr(&msg, ns_s_an, i, &rr) < 0 || ns_rr_type(rr) != ns_t_mx ||
+			    ns_rr_rdlen(rr) < 3) continue;
+			const unsigned char *rdata = ns_rr_rdata(rr);
+			if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), rdata + 2, host, sizeof(host)) < 0 ||
+			    strlen(host) > DOMAIN_LEN) continue;
+			/* A null MX says that the domain takes no mail at all. */
+			if (host[0] == '\0' || strcmp(host, ".") == 0) {
+				fprintf(stderr, "! %s takes no mail\n", domain);
+				return 0;
+			}
+			/* Keep them sorted by preference, dropping the least preferred. */
+			int pref = ns_get16(rdata), j = n < MAX_MX ? n++ : MAX_MX;
+			for (; j > 0 && prefs[j-1] > pref; --j) {
+				if (j < MAX_MX) {
+					prefs[j] = prefs[j-1];
+					strcpy(hosts[j], hosts[j-1]);
+				}
+			}
+			if (j < MAX_MX) {
+				prefs[j] = pref;
+				strcpy(hosts[j], host);
+			}
+		}
+	}
+	if (n == 0) {
+		strcpy(hosts[0], domain);
+		n = 1;
+	}
+	return n;
+}
+
+/* Connects to one of the addresses in list. Returns the socket, or -1. */
+static int dial(const struct addrinfo *list)
+{
+	struct timeval tv = { .tv_sec = REPLY_TIMEOUT };
+	for (const struct addrinfo *ai = list; ai != NULL; ai = ai->ai_next) {
+		int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0) continue;
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) return sock;
+		close(sock);
+	}
+	return -1;
+}
+
+/* Connects to the destination and says EHLO. Returns 0 if that fails. */
+static int greet(const char *domain)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct addrinfo *list;
+	char hosts[MAX_MX][DOMAIN_LEN+1];
+	char cmd[COMMAND_LEN+1];
+	int sock = -1, err, n;
+	if (relay_addr != NULL) {
+		sock = dial(relay_addr);
+	} else {
+		if ((n = mxlookup(domain, hosts)) == 0) return 0;
+		for (int i = 0; i < n && sock < 0; ++i) {
+			if ((err = getaddrinfo(hosts[i], relay_port, &hints, &list)) != 0) {
+				fprintf(stderr, "! %s: %s\n", hosts[i], gai_strerror(err));
+				continue;
+			}
+			sock = dial(list);
+			freeaddrinfo(list);
+		}
+	}
+	if (sock < 0) {
+		fprintf(stderr, "! Can't connect to %s: %s\n", domain, strerror(errno));
+		return 0;
+	}
+	cn = &conn;
+	cn->sock = sock;
+	cn->read = cread_plain;
+	cn->write = cwrite_plain;
+	if (getreply(0) != 220) return 0;
+	snprintf(cmd, sizeof(cmd), "EHLO %s\r\n", my_domain);
+	cwritent(cmd);
+	int code = getreply(1);
+	if (code < 0) return 0;
+	if (code != 250) {
+		pipelining = chunking = eightbit = binarymime = 0;
+		snprintf(cmd, sizeof(cmd), "HELO %s\r\n", my_domain);
+		cwritent(cmd);
+		if (getreply(0) != 250) return 0;
+	}
+	return 1;
+}
+
+static int sendall(const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(cn->sock, buf, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		buf += n, len -= n;
+	}
+	return 1;
+}
+
+/* Sends the file fd from *pos up to end. */
+static int sendrange(int fd, off_t *pos, off_t end)
+{
+	while (*pos < end) {
+		ssize_t n = sendfile(cn->sock, fd, pos, end - *pos);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+	}
+	return 1;
+}
+
+/* Sends the body of a message straight from the queue. With stuff set, it
+ * is sent the way DATA needs it: dot-stuffed and with the final dot. */
+static int sendbody(int fd, off_t size, int stuff)
+{
+	int on = 1, off = 0, ok = 1;
+	off_t pos = 0;
+	/* Don't let the stuffed dots go out in packets of their own. */
+	setsockopt(cn->sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	if (stuff && size > 0) {
+		char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			ioerr("mmap");
+			return 0;
+		}
+		const char *p = map, *end = map + size;
+		if (map[0] == '.') ok = sendall(".", 1);
+		while (ok && (p = dotscan(p, end)) != NULL) {
+			p += 2;
+			ok = sendrange(fd, &pos, p - map) && sendall(".", 1);
+		}
+		ok = ok && sendrange(fd, &pos, size);
+		if (ok && (size < 2 || memcmp(end - 2, "\r\n", 2) != 0)) ok = sendall("\r\n", 2);
+		munmap(map, size);
+	} else {
+		ok = sendrange(fd, &pos, size);
+	}
+	if (ok && stuff) ok = sendall(".\r\n", 3);
+	setsockopt(cn->sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	return ok;
+}
+
+/* Runs a transaction for the queued message name. */
+static int transfer(const char *name)
+{
+	char path[QPATH_LEN], cmd[COMMAND_LEN+1];
+	struct envelope env;
+	struct stat st;
+	sprintf(path, ".queue/env/%s", name);
+	/* The master has read it already, so it's just gone. */
+	if (!envload(&env, path)) return R_SENT;
+	sprintf(path, ".queue/msg/%s", name);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		ioerr("open");
+		if (fd >= 0) close(fd);
+		envfree(&env);
+		return R_DEFERRED;
+	}
+	if (env.body == BODY_BINARYMIME && !(chunking && binarymime)) {
+		/* Sent after DATA, it would be damaged. */
+		fprintf(stderr, "! %s: The server for %s can't take binary messages\n", name, env.domain);
+		close(fd);
+		envfree(&env);
+		return R_DEFERRED;
+	}
+	const char **rcpts = malloc((env.nrcpts + 1) * sizeof(rcpts[0]));
+	const char **deferred = malloc((env.nrcpts + 1) * sizeof(deferred[0]));
+	const char **rejected = malloc((env.nrcpts + 1) * sizeof(rejected[0]));
+	if ((codes = malloc((env.nrcpts + 4) * sizeof(codes[0]))) == NULL ||
+	    rcpts == NULL || deferred == NULL || rejected == NULL) die("malloc:");
+	ncodes = nread = 0;
+	int ok = 1, final = 0, n = env.nrcpts;
+
+	if (used) ok = command("RSET\r\n");
+	used = 1;
+	int mail = ncodes;
+	const char *body = "";
+	if (env.body == BODY_BINARYMIME) body = " BODY=BINARYMIME";
+	else if (env.body == BODY_8BITMIME && eightbit) body = " BODY=8BITMIME";
+	snprintf(cmd, sizeof(cmd), "MAIL FROM:<%s%s%s>%s\r\n", env.sender_local,
+		env.sender_domain[0] ? "@" : "", env.sender_domain, body);
+	ok = ok && command(cmd);
+	int first = ncodes;
+	for (int i = 0; i < n; ++i) {
+		rcpts[i] = envrcpt(&env);
+		snprintf(cmd, sizeof(cmd), "RCPT TO:<%s@%s>\r\n", rcpts[i], env.domain);
+		ok = ok && command(cmd);
+	}
+	int accepted = pipelining;
+	for (int i = 0; i < n && !accepted; ++i) accepted = codes[mail] == 250 && codes[first + i] / 100 == 2;
+	if (ok && accepted && chunking) {
+		snprintf(cmd, sizeof(cmd), "BDAT %lld LAST\r\n", (long long) st.st_size);
+		cwritent(cmd);
+		++ncodes;
+		cflush();
+		ok = !cn->dead && sendbody(fd, st.st_size, 0) && readreplies();
+		final = codes[ncodes - 1];
+	} else if (ok && accepted) {
+		ok = command("DATA\r\n") && readreplies();
+		final = codes[ncodes - 1];
+		if (ok && final == 354) {
+			++ncodes;
+			ok = sendbody(fd, st.st_size, 1) && readreplies();
+			final = codes[ncodes - 1];
+		}
+	} else if (ok) {
+		ok = readreplies();
+	}
+	close(fd);
+
+	int status = R_FAILED, nd = 0, nr = 0;
+	if (ok) {
+		for (int i = 0; i < n; ++i) {
+			int code = codes[mail] / 100 != 2 ? codes[mail] : codes[first + i];
+			if (code / 100 == 2) code = final;
+			if (code / 100 == 2) continue;
+			if (code / 100 == 5) {
+				fprintf(stderr, "! %s: %s@%s rejected with %d\n", name, rcpts[i], env.domain, code);
+				rejected[nr++] = rcpts[i];
+			} else {
+				fprintf(stderr, "! %s: Delivery to %s@%s deferred with %d\n", name, rcpts[i], env.domain, code);
+				deferred[nd++] = rcpts[i];
+			}
+		}
+		/* Keep the rejected recipients queued if they can't be set aside. */
+		if (nr > 0 && !qbury(name, &env, rejected, nr)) {
+			ioerr("qbury");
+			memcpy(deferred + nd, rejected, nr * sizeof(rejected[0]));
+			nd += nr;
+		}
+		status = nd > 0 ? R_DEFERRED : R_SENT;
+		if (nd == 0) qdone(name);
+		else if (nd < n && !qdefer(name, &env, deferred, nd)) ioerr("qdefer");
+	}
+	free(codes);
+	free(deferred);
+	free(rejected);
+	free(rcpts);
+	envfree(&env);
+	return status;
+}
+
+/* The main loop of a link process. */
+static void runlink(int id, const char *domain, int in, int out)
+{
+	struct job job;
+	struct result res = { .link = id };
+	int connected = 0;
+	while (read(in, &job, sizeof(job)) == sizeof(job)) {
+		res.slot = job.slot;
+		if (!connected && !(connected = greet(domain))) res.status = R_FAILED;
+		else res.status = transfer(job.name);
+		if (write(out, &res, sizeof(res)) != sizeof(res)) die("write:");
+		if (res.status == R_FAILED) exit(1);
+	}
+	if (connected) {
+		cwritent("QUIT\r\n");
+		getreply(0);
+	}
+	exit(0);
+}
+
+static int spawnlink(int d)
+{
+	int l = 0, jobs[2];
+	while (l < MAX_LINKS && links[l].pid != 0) ++l;
+	if (l == MAX_LINKS) return -1;
+	if (pipe(jobs) < 0) {
+		ioerr("pipe");
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		ioerr("fork");
+		close(jobs[0]);
+		close(jobs[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		for (int o = 0; o < MAX_LINKS; ++o) {
+			if (links[o].pid != 0) close(links[o].fd);
+		}
+		close(jobs[1]);
+		close(resultfds[0]);
+		close(watchfd);
+		runlink(l, dests[d].domain, jobs[0], resultfds[1]);
+	}
+	close(jobs[0]);
+	links[l] = (struct link) { .pid = pid, .fd = jobs[1], .dest = d, .slot = -1, .idle = now() };
+	++dests[d].nlinks;
+	return l;
+}
+
+/* Leaves destination d alone for a while. */
+static void backoff(int d)
+{
+	dests[d].retry = now() + RETRY_INTERVAL;
+	dests[d].parked = 1;
+}
+
+/* Forgets about a message, which stays queued. */
+static void drop(int s)
+{
+	msgs[s].used = 0;
+	--dests[msgs[s].dest].nmsgs;
+	--nused;
+}
+
+/* Closes a link, which makes its process quit. */
+static void droplink(int l)
+{
+	struct link *k = &links[l];
+	close(k->fd);
+	--dests[k->dest].nlinks;
+	if (k->slot >= 0) {
+		backoff(k->dest);
+		drop(k->slot);
+	}
+	k->pid = 0;
+}
+
+static int finddest(const char *domain)
+{
+	int unused = -1;
+	long t = now();
+	for (int d = 0; d < MAX_DESTS; ++d) {
+		struct dest *x = &dests[d];
+		if (x->nlinks == 0 && x->nmsgs == 0 && !x->parked && x->retry <= t) {
+			if (unused < 0) unused = d;
+		} else if (strcasecmp(x->domain, domain) == 0) {
+			return d;
+		}
+	}
+	if (unused >= 0) {
+		strcpy(dests[unused].domain, domain);
+		dests[unused].retry = 0;
+	}
+	return unused;
+}
+
+static int inflight(const char *name)
+{
+	for (int s = 0; s < MAX_INFLIGHT; ++s) {
+		if (msgs[s].used && strcmp(msgs[s].name, name) == 0) return 1;
+	}
+	return 0;
+}
+
+/* Takes the message on for relaying if it is for another domain.
+ * Returns 0 if it has to wait. */
+static int take(const char *name)
+{
+	char path[QPATH_LEN];
+	struct envelope env;
+	if (nused == MAX_INFLIGHT) return 0;
+	if (inflight(name)) return 1;
+	sprintf(path, ".queue/env/%s", name);
+	if (!envload(&env, path)) {
+		/* It may just have been taken out of the queue. */
+		if (errno != ENOENT) fprintf(stderr, "! Damaged envelope %s\n", name);
+		return 1;
+	}
+	if (strcasecmp(env.domain, my_domain) == 0 || strlen(env.domain) > DOMAIN_LEN) {
+		envfree(&env);
+		return 1;
+	}
+	int d = finddest(env.domain);
+	envfree(&env);
+	if (d < 0) return 0;
+	if (dests[d].retry > now()) {
+		dests[d].parked = 1;
+		return 1;
+	}
+	int s = 0;
+	while (msgs[s].used) ++s;
+	msgs[s].used = 1;
+	strcpy(msgs[s].name, name);
+	msgs[s].dest = d;
+	++dests[d].nmsgs;
+	++nused;
+	order[(ohead + olen++) % MAX_INFLIGHT] = s;
+	return 1;
+}
+
+/* Hands the message in slot s to a link. Returns 0 if it has to wait. */
+static int assign(int s)
+{
+	struct job job;
+	struct dest *d = &dests[msgs[s].dest];
+	if (d->retry > now()) {
+		d->parked = 1;
+		drop(s);
+		return 1;
+	}
+	int l = 0;
+	while (l < MAX_LINKS && !(links[l].pid != 0 && links[l].dest == msgs[s].dest && links[l].slot < 0)) ++l;
+	if (l == MAX_LINKS) {
+		if (d->nlinks >= maxlinks || (l = spawnlink(msgs[s].dest)) < 0) return 0;
+	}
+	memset(&job, 0, sizeof(job));
+	job.slot = s;
+	strcpy(job.name, msgs[s].name);
+	if (write(links[l].fd, &job, sizeof(job)) != sizeof(job)) {
+		droplink(l);
+		return 0;
+	}
+	links[l].slot = s;
+	return 1;
+}
+
+static void dispatch(void)
+{
+	for (int n = olen; n > 0; --n) {
+		int s = order[ohead];
+		ohead = (ohead + 1) % MAX_INFLIGHT;
+		--olen;
+		if (!assign(s)) order[(ohead + olen++) % MAX_INFLIGHT] = s;
+	}
+}
+
+/* Looks through the queue again once parked or deferred messages may be
+ * tried again. Returns how long until that is the case next, or -1. */
+static long retries(void)
+{
+	long t = now(), next = -1;
+	int due = 0;
+	if (rerun >= 0 && rerun <= t) {
+		rerun = -1;
+		due = 1;
+	} else if (rerun >= 0) {
+		next = rerun - t;
+	}
+	for (int d = 0; d < MAX_DESTS; ++d) {
+		if (!dests[d].parked) continue;
+		if (dests[d].retry <= t) {
+			dests[d].parked = 0;
+			due = 1;
+		} else if (next < 0 || dests[d].retry - t < next) {
+			next = dests[d].retry - t;
+		}
+	}
+	if (due) qrescan();
+	return next;
+}
+
+static void collect(void)
+{
+	struct result res;
+	struct pollfd pfd = { .fd = resultfds[0], .events = POLLIN };
+	/* Don't wait for more results once the pipe is empty. */
+	do {
+		if (read(resultfds[0], &res, sizeof(res)) != sizeof(res)) {
+			ioerr("read");
+			return;
+		}
+		struct link *k = &links[res.link];
+		/* The link may have been given up on already. */
+		if (k->pid == 0 || k->slot != res.slot) continue;
+		/* Only a failed connection says something about the destination.
+		 * Deferred messages are looked for again a while later. */
+		if (res.status == R_FAILED) backoff(k->dest);
+		else if (res.status == R_DEFERRED && rerun < 0) rerun = now() + RETRY_INTERVAL;
+		drop(res.slot);
+		k->slot = -1;
+		k->idle = now();
+		if (res.status == R_FAILED) droplink(res.link);
+	} while (poll(&pfd, 1, 0) > 0);
+}
+
+int main()
+{
+	const char *conf[NUM_CF_FIELDS];
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	struct pollfd pfds[2+MAX_LINKS];
+	int owner[2+MAX_LINKS];
+	loadconf(conf, findconf());
+	if (strlen(conf[CF_DOMAIN]) >= sizeof(my_domain))
+		die("Domain name is too long.");
+	strcpy(my_domain, conf[CF_DOMAIN]);
+	if (strlen(conf[CF_RELAY_HOST]) >= sizeof(relay_host))
+		die("relay_host is too long.");
+	strcpy(relay_host, conf[CF_RELAY_HOST]);
+	if (strlen(conf[CF_RELAY_PORT]) >= sizeof(relay_port))
+		die("relay_port is too long.");
+	strcpy(relay_port, conf[CF_RELAY_PORT]);
+	if ((maxlinks = confnum(conf[CF_RELAY_CONNECTIONS])) < 1)
+		die("relay_connections must be at least 1.");
+	nshards = confnum(conf[CF_QUEUE_SHARDS]);
+	if (nshards < 1 || nshards > MAX_SHARDS)
+		die("queue_shards must be between 1 and %d.", MAX_SHARDS);
+	/* This also loads everything the resolver needs before the chroot. */
+	int err = getaddrinfo(relay_host[0] ? relay_host : "localhost", relay_port, &hints, &relay_addr);
+	if (err != 0 && relay_host[0]) die("%s: %s", relay_host, gai_strerror(err));
+	if (!relay_host[0] && err == 0) {
+		freeaddrinfo(relay_addr);
+		relay_addr = NULL;
+	}
+	if (!relay_host[0] && res_init() < 0) die("Can't set up the resolver.");
+	dropprivs(conf);
+	freeconf(conf);
+	mkshards(nshards);
+	reapchildren();
+	signal(SIGPIPE, SIG_IGN);
+	if (pipe(resultfds) < 0) die("pipe:");
+	watchfd = qwatch();
+	for (;;) {
+		long timeout = retries();
+		qready(take);
+		dispatch();
+		/* A link whose process is gone shows up with POLLERR. */
+		int n = 2;
+		pfds[0] = (struct pollfd) { .fd = resultfds[0], .events = POLLIN };
+		pfds[1] = (struct pollfd) { .fd = watchfd, .events = POLLIN };
+		for (int l = 0; l < MAX_LINKS; ++l) {
+			if (links[l].pid == 0) continue;
+			pfds[n] = (struct pollfd) { .fd = links[l].fd };
+			owner[n++] = l;
+			long idle = links[l].idle + LINK_IDLE - now();
+			if (links[l].slot < 0 && (timeout < 0 || idle < timeout)) timeout = idle > 0 ? idle : 0;
+		}
+		int r = poll(pfds, n, timeout);
+		if (r < 0 && errno != EINTR) die("poll:");
+		if (r > 0 && (pfds[0].revents & POLLIN)) collect();
+		for (int i = 2; r > 0 && i < n; ++i) {
+			int l = owner[i];
+			if ((pfds[i].revents & (POLLERR | POLLHUP)) && links[l].pid != 0 && links[l].fd == pfds[i].fd)
+				droplink(l);
+		}
+		for (int l = 0; l < MAX_LINKS; ++l) {
+			if (links[l].pid != 0 && links[l].slot < 0 && now() - links[l].idle >= LINK_IDLE)
+				droplink(l);
+		}
+	}
+}
@@ -22,6 +22,32 @@ static const char *field_names[] = {
 	"ca_file",
 	"cert_file",
 	"key_file",
+	"mode",
+	"workers",
+	"pin_workers",
+	"splice_data",
+	"durability",
+	"queue_shards",
+	"envelope_format",
+	"max_mailboxes",
+	"ports",
+	"stats_socket",
+	"trace",
+	"delivery_workers",
+	"relay_host",
+	"relay_port",
+	"relay_connections",
+	"backlog",
+	"defer_accept",
+	"fastopen",
+	"max_sessions",
+	"max_listener_sessions",
+	"max_ip_sessions",
+	"max_net_sessions",
+	"ip_rate",
+	"ip_burst",
+	"net_rate",
+	"net_burst",
 };
 
 static const char *field_defaults[] = {
@@ -33,6 +59,32 @@ static const char *field_defaults[] = {
 	"",
 	"",
 	"",
+	"event",
+	"0",
+	"NO",
+	"YES",
+	"group",
+	"16",
+	"bq3",
+	"65536",
+	"25 587",
+	".stats",
+	"NO",
+	"0",
+	"",
+	"25",
+	"4",
+	"1024",
+	"0",
+	"0",
+	"0",
+	"0",
+	"0",
+	"0",
+	"0",
+	"10",
+	"0",
+	"50",
 };
 
 static int iskeyc(int c)
@@ -153,6 +205,15 @@ int yesno(const char *value)
 	return 0;
 }
 
+int confnum(const char *value)
+{
+	char *end;
+	long num = strtol(value, &end, 10);
+	if (*value == '\0' || *end != '\0' || num < 0 || num > INT_MAX)
+		die("Config value must be a non-negative number.");
+	return (int) num;
+}
+
 void dropprivs(const char *conf[])
 {
 	struct group *grp = NULL;
@@ -9,6 +9,32 @@ enum {
 	CF_CA_FILE,
 	CF_CERT_FILE,
 	CF_KEY_FILE,
+	CF_MODE,
+	CF_WORKERS,
+	CF_PIN_WORKERS,
+	CF_SPLICE_DATA,
+	CF_DURABILITY,
+	CF_QUEUE_SHARDS,
+	CF_ENVELOPE_FORMAT,
+	CF_MAX_MAILBOXES,
+	CF_PORTS,
+	CF_STATS_SOCKET,
+	CF_TRACE,
+	CF_DELIVERY_WORKERS,
+	CF_RELAY_HOST,
+	CF_RELAY_PORT,
+	CF_RELAY_CONNECTIONS,
+	CF_BACKLOG,
+	CF_DEFER_ACCEPT,
+	CF_FASTOPEN,
+	CF_MAX_SESSIONS,
+	CF_MAX_LISTENER_SESSIONS,
+	CF_MAX_IP_SESSIONS,
+	CF_MAX_NET_SESSIONS,
+	CF_IP_RATE,
+	CF_IP_BURST,
+	CF_NET_RATE,
+	CF_NET_BURST,
 	CF__DATA_,
 	NUM_CF_FIELDS
 };
@@ -17,5 +43,6 @@ const char *findconf(void);
 void loadconf(const char *conf[], const char *filename);
 void freeconf(const char *conf[]);
 int yesno(const char *value);
+int confnum(const char *value);
 void dropprivs(const char *conf[]);
 
@@ -6,10 +6,13 @@ LD = cc
 
 # flags
 CPPFLAGS = -D_XOPEN_SOURCE=700 -D_DEFAULT_SOURCE
+# Add -DNO_TRACE to leave out phase tracing (the "trace" option) entirely.
 CFLAGS = -std=c99 -pedantic -Wall -Wextra -Os -fPIE
 LDFLAGS = -s -pie
 
 TLSLIBS = -ltls
+# for the MX lookups of bmailrelay
+RESOLVLIBS = -lresolv
 
 # installation paths
 PREFIX = /usr/local
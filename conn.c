@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 
 #include <tls.h>
 
@@ -11,15 +13,26 @@
 #include "conn.h"
 #include "util.h"
 
-int cnsock;
-struct tls *cntls = NULL;
-int (*cread)(char *buf, int max);
-int (*cwrite)(char *buf, int max);
+struct conn *cn;
 
 static void tlserr(const char *func)
 {
-	fprintf(stderr, "%s: %s\n", func, tls_error(cntls));
-	exit(1);
+	fprintf(stderr, "%s: %s\n", func, tls_error(cn->tls));
+	cn->dead = 1;
+}
+
+static void connerr(const char *func)
+{
+	switch (errno) {
+	case EINTR: case EAGAIN:
+		return;
+	case ECONNRESET: case ETIMEDOUT: case EPIPE:
+		break;
+	default:
+		fprintf(stderr, "! %s: %s\n", func, strerror(errno));
+		break;
+	}
+	cn->dead = 1;
 }
 
 struct tls_config *conftls(const char *conf[])
@@ -39,59 +52,132 @@ struct tls_config *conftls(const char *conf[])
 
 int cread_plain(char *buf, int max)
 {
-	ssize_t s = read(cnsock, buf, max);
-	if (s < 0) ioerr("read");
-	if (s == 0) exit(1);
-	return (int) s;
+	if (cn->dead) return 0;
+	ssize_t s = read(cn->sock, buf, max);
+	if (s < 0) connerr("read");
+	if (s == 0) cn->dead = 1;
+	return s > 0 ? (int) s : 0;
 }
 
 int cwrite_plain(char *buf, int max)
 {
-	ssize_t s = write(cnsock, buf, max);
-	if (s < 0) ioerr("write");
-	if (s == 0) exit(1);
-	return (int) s;
+	if (cn->dead) return 0;
+	ssize_t s = write(cn->sock, buf, max);
+	if (s < 0) connerr("write");
+	if (s == 0) cn->dead = 1;
+	cn->wait = POLLOUT;
+	return s > 0 ? (int) s : 0;
 }
 
 int cread_tls(char *buf, int max)
 {
-	ssize_t s = tls_read(cntls, buf, max);
+	if (cn->dead) return 0;
+	ssize_t s = tls_read(cn->tls, buf, max);
+	/* A handshake may have to write before there is anything to read. */
+	cn->wait = s == TLS_WANT_POLLOUT ? POLLOUT : POLLIN;
+	if (s == TLS_WANT_POLLIN || s == TLS_WANT_POLLOUT) return 0;
 	if (s < 0) tlserr("tls_read");
-	if (s == 0) exit(1);
-	return (int) s;
+	if (s == 0) cn->dead = 1;
+	return s > 0 ? (int) s : 0;
 }
 
 int cwrite_tls(char *buf, int max)
 {
-	ssize_t s = tls_write(cntls, buf, max);
+	if (cn->dead) return 0;
+	ssize_t s = tls_write(cn->tls, buf, max);
+	cn->wait = s == TLS_WANT_POLLIN ? POLLIN : POLLOUT;
+	if (s == TLS_WANT_POLLIN || s == TLS_WANT_POLLOUT) return 0;
 	if (s < 0) tlserr("tls_write");
-	if (s == 0) exit(1);
-	return (int) s;
+	if (s == 0) cn->dead = 1;
+	return s > 0 ? (int) s : 0;
 }
 
-int creadln(char *buf, int max)
+int cfill(void)
 {
-	char c;
-	int cr = 0;
-	for (int i = 0; i < max; ++i) {
-		cread(&c, 1);
-		buf[i] = c;
-		if (cr && c == '\n') return 1;
-		cr = (c == '\r');
-	}
-	for (;;) {
-		cread(&c, 1);
-		if (cr && c == '\n') return 0;
-		cr = (c == '\r');
+	if (!cflush()) return 0;
+	if (cn->inhead > 0) {
+		cn->intail -= cn->inhead;
+		memmove(cn->in, cn->in + cn->inhead, cn->intail);
+		cn->inhead = 0;
 	}
+	if (cn->intail >= CONN_BUF_LEN) return 0;
+	int n = cn->read(cn->in + cn->intail, CONN_BUF_LEN - cn->intail);
+	cn->intail += n;
+	return n;
+}
+
+int creadln(char **line, int max)
+{
+	do {
+		char *start = cn->in + cn->inhead;
+		char *end = cn->in + cn->intail;
+		char *lf = start + cn->lnscan;
+		while ((lf = memchr(lf, '\n', end - lf)) != NULL) {
+			if (lf > start && lf[-1] == '\r') break;
+			++lf;
+		}
+		if (lf != NULL) {
+			int len = lf + 1 - start;
+			int skip = cn->lnskip || len > max;
+			cn->inhead += len;
+			cn->lnscan = 0, cn->lnskip = 0;
+			*line = start;
+			return !skip;
+		}
+		cn->lnscan = end - start;
+		if (cn->lnscan >= max) {
+			/* Throw away the overlong line, but keep its last byte
+			 * as it might be the CR of the final CR LF. */
+			cn->inhead = cn->intail - 1;
+			cn->lnscan = 1, cn->lnskip = 1;
+		}
+	} while (cfill() > 0);
+	return -1;
 }
 
 void cwritent(char *buf)
 {
 	int len = strlen(buf);
-	while (len > 0) {
-		int adv = cwrite(buf, len);
-		buf += adv, len -= adv;
+	while (len > 0 && !cn->dead) {
+		if (cn->outlen == CONN_OUT_LEN && !cflush()) {
+			/* Callers are supposed to check cbusy(), so this is a bug.
+			 * Waiting here would stall all sessions of the process. */
+			memmove(cn->out, cn->out + cn->outhead, cn->outlen - cn->outhead);
+			cn->outlen -= cn->outhead;
+			cn->outhead = 0;
+			if (cn->outlen == CONN_OUT_LEN) {
+				fprintf(stderr, "! Output buffer overrun, dropping the connection.\n");
+				cn->dead = 1;
+			}
+			continue;
+		}
+		int n = CONN_OUT_LEN - cn->outlen;
+		if (n > len) n = len;
+		memcpy(cn->out + cn->outlen, buf, n);
+		cn->outlen += n;
+		buf += n, len -= n;
 	}
 }
 
+int cflush(void)
+{
+	while (cn->outhead < cn->outlen) {
+		int n = cn->write(cn->out + cn->outhead, cn->outlen - cn->outhead);
+		if (n == 0) return cn->dead;
+		cn->outhead += n;
+	}
+	cn->outhead = cn->outlen = 0;
+	cn->wait = POLLIN;
+	if (cn->starttls) {
+		cn->read = cread_tls;
+		cn->write = cwrite_tls;
+		cn->starttls = 0;
+	}
+	return 1;
+}
+
+int cbusy(void)
+{
+	if (cn->outlen + REPLY_MAX <= CONN_OUT_LEN) return 0;
+	return !cflush();
+}
@@ -2,16 +2,61 @@
 
 /* needs tls.h */
 
-extern int cnsock;
-extern struct tls *cntls;
-extern int (*cread)(char *buf, int max);
-extern int (*cwrite)(char *buf, int max);
+#define CONN_BUF_LEN 16384
+#define CONN_OUT_LEN 4096
+/* No single SMTP reply may be longer than this. */
+#define REPLY_MAX 1024
+
+struct conn
+{
+	int sock;
+	struct tls *tls;
+	int (*read)(char *buf, int max);
+	int (*write)(char *buf, int max);
+	/* Set once the peer is gone. All further I/O on the connection is ignored. */
+	int dead;
+	/* Switch to TLS as soon as the output buffer has been flushed. */
+	int starttls;
+	/* What the last read or write that could not complete is waiting for
+	 * (POLLIN or POLLOUT). POLLIN once all output is sent. */
+	short wait;
+	/* Input that has been read but not consumed yet is in[inhead..intail). */
+	char in[CONN_BUF_LEN];
+	int inhead;
+	int intail;
+	/* Replies that have not been sent yet are in out[outhead..outlen). */
+	char out[CONN_OUT_LEN];
+	int outhead;
+	int outlen;
+	/* Progress of a partially read line, see creadln(). */
+	int lnscan;
+	int lnskip;
+};
+
+/* The connection that all c* functions operate on. */
+extern struct conn *cn;
 
 struct tls_config *conftls(const char *conf[]);
+/* The read and write functions return the number of bytes transferred,
+ * or 0 if that would block right now or the connection is dead. */
 int cread_plain(char *buf, int max);
 int cwrite_plain(char *buf, int max);
 int cread_tls(char *buf, int max);
 int cwrite_tls(char *buf, int max);
-int creadln(char *buf, int max);
+/* Sends out all buffered replies first, then reads as much input into the
+ * connection's buffer as fits and is available. Returns the number of new bytes. */
+int cfill(void);
+/* Takes the next CR LF terminated line of at most max bytes from the input
+ * buffer and points *line at it. The line is not copied, so it stays valid only
+ * until the next call to cfill(). Returns 1 if a complete line was read, 0 if an
+ * overlong line was discarded, and -1 if the line is not complete yet. In that
+ * case, call again once more input is available. */
+int creadln(char **line, int max);
+/* Appends a reply to the output buffer. Replies are only sent when the client
+ * has to wait for them, so that pipelined commands get answered in one go. */
 void cwritent(char *buf);
-
+/* Sends out all buffered replies. Returns 0 if that would block. */
+int cflush(void);
+/* Flushes the output buffer if it can't take another reply.
+ * Returns 1 if it still can't, so the caller must wait until it can write. */
+int cbusy(void);
@@ -0,0 +1,295 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "smtp.h"
+#include "env.h"
+
+/* The names of the body types in bq3, by BODY_* value. */
+static const char *bodynames[] = { "7BIT", "8BITMIME", "BINARYMIME" };
+
+static uint32_t crctab[256];
+
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	if (crctab[1] == 0) {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) {
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			}
+			crctab[i] = c;
+		}
+	}
+	crc = ~crc;
+	while (len--) {
+		crc = crctab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static void put16(unsigned char *p, unsigned v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = v >> 24;
+}
+
+static unsigned get16(const char *p)
+{
+	const unsigned char *u = (const unsigned char *) p;
+	return u[0] | u[1] << 8;
+}
+
+static uint32_t get32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *) p;
+	return u[0] | u[1] << 8 | (uint32_t) u[2] << 16 | (uint32_t) u[3] << 24;
+}
+
+static void setiov(struct iovec *iov, const void *base, size_t len)
+{
+	iov->iov_base = (void *) base;
+	iov->iov_len = len;
+}
+
+static int writeall(int fd, struct iovec *iov, int n)
+{
+	while (n > 0) {
+		ssize_t w = writev(fd, iov, n < IOV_MAX ? n : IOV_MAX);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+		while (n > 0 && (size_t) w >= iov->iov_len) {
+			w -= iov->iov_len;
+			++iov, --n;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 1;
+}
+
+static int writebq3(int fd, const char *fields[], int nfields, int body)
+{
+	struct iovec *iov;
+	int n = 0, ok;
+	if ((iov = calloc(2 * nfields + 4, sizeof(iov[0]))) == NULL) return 0;
+	setiov(&iov[n++], "bq3\n", 4);
+	for (int i = 0; i < nfields; ++i) {
+		setiov(&iov[n++], fields[i], strlen(fields[i]));
+		setiov(&iov[n++], "\n", 1);
+		if (i == 2) {
+			setiov(&iov[n++], "-- ", 3);
+			setiov(&iov[n++], bodynames[body], strlen(bodynames[body]));
+			setiov(&iov[n++], "\n", 1);
+		}
+	}
+	ok = writeall(fd, iov, n);
+	free(iov);
+	return ok;
+}
+
+static int writebq4(int fd, const char *fields[], int nfields, int body)
+{
+	/* The checksum is computed while that field is still zero. */
+	unsigned char hdr[BQ4_HEADER_LEN] = "bq4", *lens;
+	struct iovec *iov;
+	size_t size = BQ4_HEADER_LEN;
+	int n = 0, ok;
+	iov = calloc(2 * nfields + 1, sizeof(iov[0]));
+	lens = malloc(2 * nfields);
+	if (iov == NULL || lens == NULL) {
+		free(iov);
+		free(lens);
+		return 0;
+	}
+	setiov(&iov[n++], hdr, BQ4_HEADER_LEN);
+	for (int i = 0; i < nfields; ++i) {
+		size_t len = strlen(fields[i]);
+		if (len > 0xFFFF) {
+			errno = EINVAL;
+			free(iov);
+			free(lens);
+			return 0;
+		}
+		put16(lens + 2 * i, len);
+		setiov(&iov[n++], lens + 2 * i, 2);
+		setiov(&iov[n++], fields[i], len + 1);
+		size += len + 3;
+	}
+	put32(hdr + 4, size);
+	put32(hdr + 8, (uint32_t) body << 24 | (nfields - 3));
+	uint32_t crc = 0;
+	for (int i = 0; i < n; ++i) {
+		crc = crc32(crc, iov[i].iov_base, iov[i].iov_len);
+	}
+	put32(hdr + 12, crc);
+	ok = writeall(fd, iov, n);
+	free(iov);
+	free(lens);
+	return ok;
+}
+
+int envwrite(int fd, int format, const char *domain, const char *sender_local,
+	const char *sender_domain, int body, const char *rcpts[], int nrcpts)
+{
+	const char **fields;
+	int ok;
+	if (nrcpts > 0xFFFFFF) {
+		errno = EINVAL;
+		return 0;
+	}
+	if ((fields = calloc(nrcpts + 3, sizeof(fields[0]))) == NULL) return 0;
+	fields[0] = domain;
+	fields[1] = sender_local;
+	fields[2] = sender_domain;
+	memcpy(fields + 3, rcpts, nrcpts * sizeof(fields[0]));
+	if (format == ENV_BQ4) ok = writebq4(fd, fields, nrcpts + 3, body);
+	else ok = writebq3(fd, fields, nrcpts + 3, body);
+	free(fields);
+	return ok;
+}
+
+/* Loads bq3, or bq1 if legacy is set. */
+static int loadtext(struct envelope *env, int legacy)
+{
+	char *p = env->map, *end = env->map + env->size;
+	const char *lines[5];
+	int nlines = 0;
+	/* Turn the lines into strings. This only touches our private copy. */
+	if (end[-1] != '\n') return 0;
+	while (p < end) {
+		char *nl = memchr(p, '\n', end - p);
+		*nl = '\0';
+		if (nlines < 5) lines[nlines] = p;
+		++nlines;
+		p = nl + 1;
+	}
+	if (nlines < 5) return 0;
+	if (legacy) {
+		if (strcmp(lines[4], "--") != 0) return 0;
+		env->body = BODY_8BITMIME;
+	} else {
+		env->body = -1;
+		for (int b = BODY_7BIT; b <= BODY_BINARYMIME; ++b) {
+			if (strncmp(lines[4], "-- ", 3) == 0 && strcmp(lines[4] + 3, bodynames[b]) == 0) env->body = b;
+		}
+		if (env->body < 0) return 0;
+	}
+	env->domain = lines[1];
+	env->sender_local = lines[2];
+	env->sender_domain = lines[3];
+	env->nrcpts = nlines - 5;
+	env->next = lines[4] + strlen(lines[4]) + 1;
+	return 1;
+}
+
+/* Loads bq4, or bq2 if legacy is set. */
+static int loadbinary(struct envelope *env, int legacy)
+{
+	const char *fields[3];
+	const char *p = env->map, *end = env->map + env->size;
+	if (env->size < BQ4_HEADER_LEN || get32(p + 4) != env->size) return 0;
+	uint32_t crc = crc32(0, p, 12);
+	crc = crc32(crc, "\0\0\0\0", 4);
+	crc = crc32(crc, p + BQ4_HEADER_LEN, env->size - BQ4_HEADER_LEN);
+	if (crc != get32(p + 12)) return 0;
+	uint32_t body = get32(p + 8) >> 24;
+	if (legacy ? body != 0 : body > BODY_BINARYMIME) return 0;
+	env->body = legacy ? BODY_8BITMIME : (int) body;
+	if ((get32(p + 8) & 0xFFFFFF) > env->size) return 0;
+	uint32_t nfields = (get32(p + 8) & 0xFFFFFF) + 3;
+	p += BQ4_HEADER_LEN;
+	/* Make sure that envrcpt() won't step out of bounds. */
+	for (uint32_t i = 0; i < nfields; ++i) {
+		if (end - p < 3) return 0;
+		unsigned len = get16(p);
+		if ((size_t) (end - p) < len + 3 || p[len + 2] != '\0') return 0;
+		if (i < 3) fields[i] = p + 2;
+		if (i == 3) env->next = p;
+		p += len + 3;
+	}
+	if (p != end) return 0;
+	env->domain = fields[0];
+	env->sender_local = fields[1];
+	env->sender_domain = fields[2];
+	env->nrcpts = nfields - 3;
+	return 1;
+}
+
+int envload(struct envelope *env, const char *path)
+{
+	struct stat info;
+	int fd, ok = 0;
+	memset(env, 0, sizeof(*env));
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return 0;
+	if (fstat(fd, &info) < 0 || info.st_size < 4) {
+		close(fd);
+		return 0;
+	}
+	env->size = info.st_size;
+	/* The text formats get modified in place, which a private mapping allows. */
+	env->map = mmap(NULL, env->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (env->map == MAP_FAILED) {
+		env->map = NULL;
+		return 0;
+	}
+	/* Envelopes are rewritten in the format they were read in, so the old
+	 * formats come back as their successors. */
+	if (memcmp(env->map, "bq4", 4) == 0 || memcmp(env->map, "bq2", 4) == 0) {
+		env->format = ENV_BQ4;
+		ok = loadbinary(env, env->map[2] == '2');
+	} else if (memcmp(env->map, "bq3\n", 4) == 0 || memcmp(env->map, "bq1\n", 4) == 0) {
+		env->format = ENV_BQ3;
+		ok = loadtext(env, env->map[2] == '1');
+	}
+	if (!ok) {
+		envfree(env);
+		return 0;
+	}
+	env->left = env->nrcpts;
+	return 1;
+}
+
+const char *envrcpt(struct envelope *env)
+{
+	const char *rcpt;
+	if (env->left == 0) return NULL;
+	--env->left;
+	if (env->format == ENV_BQ4) {
+		rcpt = env->next + 2;
+		env->next = rcpt + get16(env->next) + 1;
+	} else {
+		rcpt = env->next;
+		env->next = rcpt + strlen(rcpt) + 1;
+	}
+	return rcpt;
+}
+
+void envfree(struct envelope *env)
+{
+	if (env->map != NULL) munmap(env->map, env->size);
+	env->map = NULL;
+}
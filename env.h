@@ -0,0 +1,62 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Envelopes of queued messages come in two formats.
+ *
+ * bq3 is plain text, one field per line:
+ *
+ *   bq3\n <domain>\n <sender local>\n <sender domain>\n -- <body>\n <rcpt local>\n ...
+ *
+ * where <body> is 7BIT, 8BITMIME or BINARYMIME.
+ *
+ * bq4 is binary, with all integers in little endian:
+ *
+ *   offset 0   "bq4\0"
+ *   offset 4   u32 size of the whole file
+ *   offset 8   u32 number of recipients in the low 24 bits, and the body
+ *              type in the top 8
+ *   offset 12  u32 CRC-32 of the whole file, with this field taken as zero
+ *   offset 16  fields: domain, sender local, sender domain, then every
+ *              recipient local part, each as u16 length, the bytes of the
+ *              field, and a terminating NUL byte that the length excludes.
+ *
+ * Since the fields are NUL-terminated, they can be used straight from a
+ * read-only mapping of the file.
+ *
+ * bq1 and bq2 are the same formats from before the body type was recorded:
+ * bq1 has a bare "--" line, and bq2 has 0 in the top 8 bits at offset 8.
+ * They are still read, as 8BITMIME, but no longer written. */
+
+enum {
+	ENV_BQ3,
+	ENV_BQ4,
+};
+
+#define BQ4_HEADER_LEN 16
+
+struct envelope
+{
+	int format;
+	char *map;
+	size_t size;
+	const char *domain;
+	const char *sender_local;
+	const char *sender_domain;
+	/* One of BODY_7BIT, BODY_8BITMIME, BODY_BINARYMIME. */
+	int body;
+	int nrcpts;
+	/* Where envrcpt() continues. */
+	const char *next;
+	int left;
+};
+
+/* Writes an envelope in the given format to fd, with as few writev() calls as
+ * possible. Returns 0 and sets errno if writing fails. */
+int envwrite(int fd, int format, const char *domain, const char *sender_local,
+	const char *sender_domain, int body, const char *rcpts[], int nrcpts);
+/* Maps the envelope at path into memory and checks that it is intact.
+ * Returns 0 if it can't be read or is damaged. */
+int envload(struct envelope *env, const char *path);
+/* Returns the next recipient local part, or NULL after the last one. */
+const char *envrcpt(struct envelope *env);
+/* Releases the mapping of an envelope. */
+void envfree(struct envelope *env);
@@ -0,0 +1,342 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE /* for accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include <tls.h>
+
+#include "smtp.h"
+#include "recv.h"
+#include "stats.h"
+#include "util.h"
+#include "peers.h"
+#include "event.h"
+
+#define MAX_EVENTS 256
+#define MAX_FDS (1 << 20)
+/* How many connections to take on per wakeup of a listening socket, so that
+ * a flood of them doesn't starve the sessions that are open already. */
+#define ACCEPT_BATCH 64
+/* How long a session may go without any progress before it is closed, in s.
+ * That is the five minutes that RFC 5321 asks a server to wait for a command. */
+#define IDLE_TIMEOUT 300
+
+#define ADD(ctr, n) __atomic_add_fetch(&(ctr), (n), __ATOMIC_RELAXED)
+
+struct slot
+{
+	struct session *sess;
+	/* Is this socket in againq or syncq? */
+	int again;
+	int sync;
+	/* The epoll events we are currently waiting for. */
+	unsigned events;
+	/* Which listening socket the session came from, or that this is. */
+	int sock;
+	struct peerref peer;
+	/* When the session was last stepped, and its neighbours in idleq. */
+	time_t active;
+	int prev, next;
+};
+
+/* Sessions indexed by their socket. Listening sockets have no session. */
+static struct slot *fdtab;
+static int nfdtab;
+/* Sockets of sessions that need to be stepped again without new input. */
+static int *againq;
+static int nagain;
+/* Sockets of sessions that wait for their messages to become durable. */
+static int *syncq;
+static int nsync;
+/* Where the results of the syncs come in, and whether one is running. */
+static int syncfd = -1;
+static int syncing;
+/* Sockets of all sessions, from the one that was stepped longest ago. */
+static int idlehead = -1, idletail = -1;
+static time_t now;
+static int epfd;
+
+struct load *loads;
+long max_sessions, max_sock_sessions;
+/* The load of this process. */
+static struct load *myload;
+
+void loadinit(int workers)
+{
+	loads = mmap(NULL, (workers + 1) * sizeof(loads[0]), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (loads == MAP_FAILED) die("mmap:");
+	myload = &loads[1];
+}
+
+/* Counts a session on the i-th listening socket in, unless that exceeds a cap. */
+static int loadtake(int i)
+{
+	int ok = 1;
+	if (ADD(loads[0].sessions, 1) > max_sessions && max_sessions > 0) ok = 0;
+	if (ADD(loads[0].socks[i], 1) > max_sock_sessions && max_sock_sessions > 0) ok = 0;
+	if (!ok) {
+		ADD(loads[0].sessions, -1);
+		ADD(loads[0].socks[i], -1);
+		return 0;
+	}
+	ADD(myload->sessions, 1);
+	ADD(myload->socks[i], 1);
+	STATINC(stats->active);
+	return 1;
+}
+
+void loadgive(int i, const struct peerref *ref)
+{
+	peergive(ref);
+	ADD(loads[0].sessions, -1);
+	ADD(loads[0].socks[i], -1);
+	ADD(myload->sessions, -1);
+	ADD(myload->socks[i], -1);
+	STATADD(stats->active, -1);
+}
+
+void loadclear(int w)
+{
+	/* Nothing else writes to the load of a dead worker. */
+	struct load *l = &loads[1 + w];
+	ADD(loads[0].sessions, -l->sessions);
+	STATADD(stats->active, -l->sessions);
+	l->sessions = 0;
+	for (int i = 0; i < MAX_SOCKS; ++i) {
+		ADD(loads[0].socks[i], -l->socks[i]);
+		l->socks[i] = 0;
+	}
+}
+
+int loadaccept(int sock, int i, int flags, struct peerref *ref)
+{
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t len = sizeof(addr);
+		int fd = accept4(sock, (struct sockaddr *) &addr, &len, flags);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) ioerr("accept4");
+			return -1;
+		}
+		int limit = peertake((struct sockaddr *) &addr, ref);
+		if (limit >= 0) {
+			recvbusy(fd, limit);
+		} else if (!loadtake(i)) {
+			peergive(ref);
+			recvbusy(fd, -1);
+		} else {
+			return fd;
+		}
+	}
+}
+
+static void idledel(int fd)
+{
+	struct slot *sl = &fdtab[fd];
+	if (sl->prev >= 0) fdtab[sl->prev].next = sl->next;
+	else idlehead = sl->next;
+	if (sl->next >= 0) fdtab[sl->next].prev = sl->prev;
+	else idletail = sl->prev;
+}
+
+static void idleadd(int fd)
+{
+	struct slot *sl = &fdtab[fd];
+	sl->active = now;
+	sl->prev = idletail;
+	sl->next = -1;
+	if (idletail >= 0) fdtab[idletail].next = fd;
+	else idlehead = fd;
+	idletail = fd;
+}
+
+/* Takes on the connections that wait on the i-th listening socket. */
+static void evaccept(int sock, int i, struct tls *tlssrv)
+{
+	struct session *s;
+	struct peerref ref;
+	int fd;
+	for (int n = 0; n < ACCEPT_BATCH && (fd = loadaccept(sock, i, SOCK_NONBLOCK | SOCK_CLOEXEC, &ref)) >= 0; ++n) {
+		if (fd >= nfdtab) {
+			close(fd);
+			loadgive(i, &ref);
+			continue;
+		}
+		if ((s = recvnew(fd, tlssrv)) == NULL) {
+			loadgive(i, &ref);
+			continue;
+		}
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			ioerr("epoll_ctl");
+			recvfree(s);
+			loadgive(i, &ref);
+			continue;
+		}
+		fdtab[fd].sess = s;
+		fdtab[fd].events = EPOLLIN;
+		fdtab[fd].sock = i;
+		fdtab[fd].peer = ref;
+		idleadd(fd);
+	}
+}
+
+static void evwait(int fd, unsigned events)
+{
+	struct slot *sl = &fdtab[fd];
+	if (sl->events == events) return;
+	struct epoll_event ev = { .events = events, .data.fd = fd };
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0) die("epoll_ctl:");
+	sl->events = events;
+}
+
+static void evstep(int fd)
+{
+	struct slot *sl = &fdtab[fd];
+	idledel(fd);
+	switch (recvstep(sl->sess)) {
+	case STEP_DONE:
+		recvfree(sl->sess);
+		sl->sess = NULL;
+		loadgive(sl->sock, &sl->peer);
+		return;
+	case STEP_INPUT:
+		evwait(fd, EPOLLIN);
+		break;
+	case STEP_AGAIN:
+		if (!sl->again) {
+			sl->again = 1;
+			againq[nagain++] = fd;
+		}
+		break;
+	case STEP_OUTPUT:
+		evwait(fd, EPOLLOUT);
+		break;
+	case STEP_SYNC:
+		if (!sl->sync) {
+			sl->sync = 1;
+			syncq[nsync++] = fd;
+		}
+		break;
+	}
+	idleadd(fd);
+}
+
+/* Steps the sessions that waited for a sync again. */
+static void evsynced(void)
+{
+	for (int i = 0; i < nsync; ++i) {
+		int fd = syncq[i];
+		fdtab[fd].sync = 0;
+		if (!fdtab[fd].again) {
+			fdtab[fd].again = 1;
+			againq[nagain++] = fd;
+		}
+	}
+	nsync = 0;
+}
+
+/* Closes the sessions that made no progress for too long. */
+static void evexpire(void)
+{
+	while (idlehead >= 0 && now - fdtab[idlehead].active >= IDLE_TIMEOUT) {
+		int fd = idlehead;
+		struct slot *sl = &fdtab[fd];
+		idledel(fd);
+		recvtimeout(sl->sess);
+		sl->sess = NULL;
+		loadgive(sl->sock, &sl->peer);
+	}
+}
+
+void evloop(const int socks[], int nsocks, int w, struct tls *tlssrv)
+{
+	struct rlimit rl;
+	myload = &loads[1 + w];
+	peerworker(w);
+	/* This has to come before there are any sessions. */
+	syncfd = recvsyncer();
+	/* Every session costs one file descriptor, so allow as many as we may. */
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) die("getrlimit:");
+	if (rl.rlim_max > MAX_FDS) rl.rlim_max = MAX_FDS;
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0) die("setrlimit:");
+	nfdtab = rl.rlim_cur;
+	if ((fdtab = calloc(nfdtab, sizeof(fdtab[0]))) == NULL) die("calloc:");
+	if ((againq = calloc(nfdtab, sizeof(againq[0]))) == NULL) die("calloc:");
+	if ((syncq = calloc(nfdtab, sizeof(syncq[0]))) == NULL) die("calloc:");
+	/* A peer hanging up must only end its own session, not the whole process. */
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) die("epoll_create1:");
+	for (int i = 0; i < nsocks; ++i) {
+		/* Every worker has sockets of its own, which the kernel
+		 * balances connections across with SO_REUSEPORT. */
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = socks[i] };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, socks[i], &ev) < 0) die("epoll_ctl:");
+		fdtab[socks[i]].sock = i;
+	}
+	if (syncfd >= 0) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = syncfd };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, syncfd, &ev) < 0) die("epoll_ctl:");
+	}
+
+	for (;;) {
+		struct epoll_event evs[MAX_EVENTS];
+		/* Wake up in time for the next session to expire. */
+		int timeout = -1;
+		if (nagain > 0) {
+			timeout = 0;
+		} else if (idlehead >= 0) {
+			long left = fdtab[idlehead].active + IDLE_TIMEOUT - now;
+			timeout = left > 0 ? left * 1000 : 0;
+		}
+		int n = epoll_wait(epfd, evs, MAX_EVENTS, timeout);
+		now = time(NULL);
+		if (n < 0) {
+			ioerr("epoll_wait");
+			continue;
+		}
+		for (int i = 0; i < n; ++i) {
+			int fd = evs[i].data.fd;
+			if (fd == syncfd) {
+				recvsynced();
+				syncing = 0;
+				evsynced();
+			} else if (fdtab[fd].sess == NULL) {
+				evaccept(fd, fdtab[fd].sock, tlssrv);
+			} else {
+				evstep(fd);
+			}
+		}
+		/* Each step re-queues at most one socket, so it is
+		 * safe to refill againq while we are still walking it. */
+		int nprev = nagain;
+		nagain = 0;
+		for (int i = 0; i < nprev; ++i) {
+			int fd = againq[i];
+			fdtab[fd].again = 0;
+			if (fdtab[fd].sess != NULL) evstep(fd);
+		}
+		/* Everything that was received since the last sync started
+		 * becomes durable in one go, while the sessions go on. */
+		if (nsync > 0 && !syncing) {
+			recvsync();
+			if (syncfd >= 0) syncing = 1;
+			else evsynced();
+		}
+		evexpire();
+	}
+}
@@ -0,0 +1,36 @@
+/* See LICENSE file for copyright and license details. */
+
+/* needs tls.h, sys/socket.h, stdint.h, peers.h */
+
+#define MAX_SOCKS 10
+
+/* Sessions that are open right now, all in all and per listening socket. */
+struct load
+{
+	long sessions;
+	long socks[MAX_SOCKS];
+};
+
+/* The load of all processes together, then that of each worker, in memory
+ * that the master shares with them. */
+extern struct load *loads;
+/* Caps on the load, or 0 for none. */
+extern long max_sessions, max_sock_sessions;
+
+/* Sets up the shared load for the given number of workers. */
+void loadinit(int workers);
+/* Accepts the next waiting connection on the listening socket sock, which is
+ * the i-th one, with the given accept4() flags. Connections that would exceed
+ * a cap or a limit of their client are turned away with 421, and the next one
+ * is tried. Returns -1 once there are no more. Otherwise, the session has been
+ * counted in for its client at *ref. */
+int loadaccept(int sock, int i, int flags, struct peerref *ref);
+/* Counts a session on the i-th listening socket out again. */
+void loadgive(int i, const struct peerref *ref);
+/* Counts out all sessions of worker w, which has died. */
+void loadclear(int w);
+
+/* Serves SMTP sessions on all listening sockets in socks from a single
+ * process, worker w, multiplexing any number of connections with epoll.
+ * Never returns. */
+void evloop(const int socks[], int nsocks, int w, struct tls *tlssrv);
@@ -0,0 +1,212 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "util.h"
+#include "peers.h"
+
+/* Must be a power of two. */
+#define PEER_SLOTS (1 << 16)
+/* How far a key may end up from its home slot. */
+#define PEER_PROBES 32
+
+/* The state of an entry packs the number of open sessions into the top bits,
+ * and the time in us at which its rate allows another burst into the rest.
+ * That is the generic cell rate algorithm: a token bucket, in one word. */
+#define TAT_BITS 48
+#define TAT_MASK ((UINT64_C(1) << TAT_BITS) - 1)
+#define SESSIONS(st) ((st) >> TAT_BITS)
+#define ONE_SESSION (UINT64_C(1) << TAT_BITS)
+/* An entry that is being handed to another client. */
+#define RECLAIMING UINT64_C(0xFFFF)
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+/* On failure, old is updated to the current value. */
+#define CAS(x, old, new) __atomic_compare_exchange_n(&(x), &(old), (new), 0, \
+	__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+/* Clients are only known by a 64-bit hash of their address, 0 is unused. */
+struct peer
+{
+	uint64_t key;
+	uint64_t state;
+};
+
+struct peerlimit peerlimits[NUM_PEER_KINDS];
+static struct peer *table;
+/* How many sessions each worker has counted into each slot, and the row of
+ * this process. Only the worker itself writes to its row while it lives. */
+static uint32_t *held;
+static uint32_t *myheld;
+
+static uint64_t usnow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a, over the kind of key and the relevant bytes of the address. */
+static uint64_t hash(int kind, const unsigned char *bytes, int len)
+{
+	uint64_t h = UINT64_C(14695981039346656037);
+	h = (h ^ kind) * UINT64_C(1099511628211);
+	h = (h ^ len) * UINT64_C(1099511628211);
+	for (int i = 0; i < len; ++i) {
+		h = (h ^ bytes[i]) * UINT64_C(1099511628211);
+	}
+	return h == 0 ? 1 : h;
+}
+
+static int peerkeys(const struct sockaddr *addr, uint64_t keys[])
+{
+	const unsigned char *a;
+	int len, netlen;
+	if (addr->sa_family == AF_INET) {
+		a = (const unsigned char *) &((const struct sockaddr_in *) addr)->sin_addr;
+		len = 4, netlen = 3;
+	} else if (addr->sa_family == AF_INET6) {
+		const struct in6_addr *a6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+		a = a6->s6_addr;
+		len = 16, netlen = 8;
+		if (IN6_IS_ADDR_V4MAPPED(a6)) {
+			a += 12;
+			len = 4, netlen = 3;
+		}
+	} else {
+		return 0;
+	}
+	keys[PEER_IP] = hash(PEER_IP, a, len);
+	keys[PEER_NET] = hash(PEER_NET, a, netlen);
+	return 1;
+}
+
+void peerinit(int workers)
+{
+	int any = 0;
+	for (int k = 0; k < NUM_PEER_KINDS; ++k) {
+		if (peerlimits[k].sessions > 0 || peerlimits[k].rate > 0) any = 1;
+	}
+	if (!any) return;
+	table = mmap(NULL, PEER_SLOTS * sizeof(table[0]), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) die("mmap:");
+	/* Only the pages of slots that are in use ever get touched. */
+	held = mmap(NULL, (size_t) workers * PEER_SLOTS * sizeof(held[0]),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (held == MAP_FAILED) die("mmap:");
+	myheld = held;
+}
+
+void peerworker(int w)
+{
+	if (table != NULL) myheld = held + (size_t) w * PEER_SLOTS;
+}
+
+/* Returns the slot of key, which it claims if need be, or -1 if there is
+ * no room near its home slot. */
+static int find(uint64_t key, uint64_t now)
+{
+	/* Entries are never emptied, so the first empty slot ends the search. */
+	for (int p = 0; p < PEER_PROBES; ++p) {
+		int s = (key + p) & (PEER_SLOTS - 1);
+		uint64_t k = LOAD(table[s].key);
+		if (k == 0 && CAS(table[s].key, k, key)) return s;
+		if (k == key) return s;
+	}
+	/* Take over an entry from a client that has nothing open and no debt. */
+	for (int p = 0; p < PEER_PROBES; ++p) {
+		int s = (key + p) & (PEER_SLOTS - 1);
+		uint64_t st = LOAD(table[s].state);
+		if (SESSIONS(st) != 0 || (st & TAT_MASK) > now) continue;
+		if (!CAS(table[s].state, st, RECLAIMING << TAT_BITS)) continue;
+		STORE(table[s].key, key);
+		STORE(table[s].state, 0);
+		return s;
+	}
+	return -1;
+}
+
+/* Counts a session out of slot s, whoever it belongs to now. */
+static void drop(int s)
+{
+	uint64_t st = LOAD(table[s].state);
+	do {
+		if (SESSIONS(st) == 0 || SESSIONS(st) == RECLAIMING) return;
+	} while (!CAS(table[s].state, st, st - ONE_SESSION));
+}
+
+/* Counts a session of the given kind of key in. Returns 0 if that would
+ * exceed a limit. Sets *slot to where it was counted, or to -1. */
+static int take(int kind, uint64_t key, uint64_t now, int *slot)
+{
+	const struct peerlimit *lim = &peerlimits[kind];
+	if (lim->sessions <= 0 && lim->rate <= 0) return 1;
+	uint64_t interval = lim->rate > 0 ? 60000000 / lim->rate : 0;
+	for (;;) {
+		int s = find(key, now);
+		if (s < 0) return 1;
+		uint64_t st = LOAD(table[s].state), next;
+		do {
+			uint64_t sessions = SESSIONS(st), tat = st & TAT_MASK;
+			if (sessions == RECLAIMING) break;
+			if (lim->sessions > 0 && sessions >= (uint64_t) lim->sessions) return 0;
+			if (sessions == RECLAIMING - 1) return 0;
+			if (interval > 0) {
+				if (tat < now) tat = now;
+				tat += interval;
+				if (tat - now > lim->burst * interval) return 0;
+			}
+			next = (sessions + 1) << TAT_BITS | tat;
+		} while (!CAS(table[s].state, st, next));
+		if (SESSIONS(st) == RECLAIMING) continue;
+		/* Did the entry go to another client before we counted in? */
+		if (LOAD(table[s].key) == key) {
+			*slot = s;
+			++myheld[s];
+			return 1;
+		}
+		drop(s);
+	}
+}
+
+int peertake(const struct sockaddr *addr, struct peerref *ref)
+{
+	uint64_t keys[NUM_PEER_KINDS];
+	for (int k = 0; k < NUM_PEER_KINDS; ++k) ref->slot[k] = -1;
+	if (table == NULL || !peerkeys(addr, keys)) return -1;
+	uint64_t now = usnow();
+	for (int k = 0; k < NUM_PEER_KINDS; ++k) {
+		ref->key[k] = keys[k];
+		if (!take(k, keys[k], now, &ref->slot[k])) {
+			peergive(ref);
+			return k;
+		}
+	}
+	return -1;
+}
+
+void peergive(const struct peerref *ref)
+{
+	for (int k = 0; k < NUM_PEER_KINDS; ++k) {
+		int s = ref->slot[k];
+		if (s < 0) continue;
+		--myheld[s];
+		drop(s);
+	}
+}
+
+void peerclear(int w)
+{
+	if (table == NULL) return;
+	uint32_t *h = held + (size_t) w * PEER_SLOTS;
+	for (int s = 0; s < PEER_SLOTS; ++s) {
+		/* An entry with sessions in it can't have gone to another client. */
+		for (; h[s] > 0; --h[s]) drop(s);
+	}
+}
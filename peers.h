@@ -0,0 +1,46 @@
+/* See LICENSE file for copyright and license details. */
+
+/* needs sys/socket.h, stdint.h */
+
+/* Limits on what a single client may do, kept in a hash table in memory that
+ * the master shares with all processes, which update it without locks. Every
+ * client counts against its own address and against its network: the /24 for
+ * IPv4, the /64 for IPv6. */
+
+enum { PEER_IP, PEER_NET, NUM_PEER_KINDS };
+
+struct peerlimit
+{
+	/* Sessions open at the same time, or 0 for no limit. */
+	long sessions;
+	/* New sessions per minute, or 0 for no limit. */
+	long rate;
+	/* How many sessions may come in at once before the rate applies. */
+	long burst;
+};
+
+extern struct peerlimit peerlimits[NUM_PEER_KINDS];
+
+/* Where a session has been counted in, so that it can be counted out again. */
+struct peerref
+{
+	int slot[NUM_PEER_KINDS];
+	uint64_t key[NUM_PEER_KINDS];
+};
+
+/* Sets up the table, unless no limits are set, along with a record of the
+ * sessions that each of the given number of workers holds. Has to be called
+ * before any workers are forked. */
+void peerinit(int workers);
+/* Makes the sessions that this process counts in those of worker w. */
+void peerworker(int w);
+/* Counts a new session from the client at addr in. Returns -1, or the kind
+ * of limit (PEER_*) that it would exceed. Clients that can't be told apart,
+ * and those for which the table has no room, are never limited. */
+int peertake(const struct sockaddr *addr, struct peerref *ref);
+/* Counts the session out again. This has to happen in the process that
+ * outlives the session: the event worker that served it, or in fork mode the
+ * master once it has reaped the session's process, which may have been killed. */
+void peergive(const struct peerref *ref);
+/* Counts out all sessions that worker w held, since it has died. */
+void peerclear(int w);
@@ -0,0 +1,216 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "util.h"
+#include "mbox.h"
+#include "queue.h"
+#include "env.h"
+#include "qrun.h"
+
+/* Names that qready() has yet to hand out. */
+#define READY_LEN 16384
+/* Watch descriptors are handed out in order, so this is plenty. */
+#define MAX_WDS 4096
+
+static int watchfd = -1;
+static int topwd = -1;
+/* The shard directory that each watch descriptor is for. */
+static char wdshard[MAX_WDS][3];
+static char ready[READY_LEN][QNAME_LEN+1];
+static int rhead, rlen;
+/* A scan through the whole queue is wanted, or is under way. */
+static int rescan = 1, scanning;
+/* Where the scan under way goes on. */
+static DIR *scantop, *scansub;
+static char scanshard[3];
+
+static int push(const char *name)
+{
+	if (rlen == READY_LEN) return 0;
+	strcpy(ready[(rhead + rlen++) % READY_LEN], name);
+	return 1;
+}
+
+static int isshard(const char *s)
+{
+	return strlen(s) == 2 && isxdigit(s[0]) && isxdigit(s[1]);
+}
+
+static int isid(const char *s)
+{
+	return s[0] != '.' && strlen(s) <= UNIQNAME_LEN;
+}
+
+static void watchshard(const char *shard)
+{
+	char path[QPATH_LEN];
+	sprintf(path, ".queue/env/%.2s", shard);
+	int wd = inotify_add_watch(watchfd, path, IN_CREATE | IN_ONLYDIR);
+	if (wd < 0) {
+		ioerr("inotify_add_watch");
+		return;
+	}
+	if (wd < MAX_WDS) sprintf(wdshard[wd], "%.2s", shard);
+}
+
+/* Goes on with the scan through the whole queue, until the ready queue is
+ * full. Returns 1 once the scan is done. */
+static int scan(void)
+{
+	char path[QPATH_LEN], name[QNAME_LEN+1];
+	struct dirent *de;
+	if (scantop == NULL && (scantop = opendir(".queue/env")) == NULL) {
+		ioerr("opendir");
+		return 1;
+	}
+	for (;;) {
+		if (rlen == READY_LEN) return 0;
+		if (scansub != NULL) {
+			if ((de = readdir(scansub)) != NULL) {
+				if (isid(de->d_name)) {
+					sprintf(name, "%s/%.*s", scanshard, UNIQNAME_LEN, de->d_name);
+					push(name);
+				}
+				continue;
+			}
+			closedir(scansub);
+			scansub = NULL;
+		}
+		if ((de = readdir(scantop)) == NULL) break;
+		if (!isshard(de->d_name)) continue;
+		sprintf(scanshard, "%.2s", de->d_name);
+		sprintf(path, ".queue/env/%s", scanshard);
+		scansub = opendir(path);
+	}
+	closedir(scantop);
+	scantop = NULL;
+	return 1;
+}
+
+int qwatch(void)
+{
+	DIR *top;
+	struct dirent *sd;
+	if ((watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) die("inotify_init1:");
+	/* New shards show up here. */
+	if ((topwd = inotify_add_watch(watchfd, ".queue/env", IN_CREATE | IN_ONLYDIR)) < 0)
+		die("inotify_add_watch:");
+	if ((top = opendir(".queue/env")) == NULL) die("opendir:");
+	while ((sd = readdir(top)) != NULL) {
+		if (isshard(sd->d_name)) watchshard(sd->d_name);
+	}
+	closedir(top);
+	return watchfd;
+}
+
+/* Moves the names from all pending events into the ready queue. */
+static void readevents(void)
+{
+	/* The union aligns the buffer for the events. */
+	union { struct inotify_event ev; char buf[65536]; } u;
+	char name[QNAME_LEN+1];
+	ssize_t n;
+	while ((n = read(watchfd, u.buf, sizeof(u.buf))) > 0) {
+		const struct inotify_event *ev;
+		for (char *p = u.buf; p < u.buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				rescan = 1;
+			} else if (ev->wd == topwd) {
+				if ((ev->mask & IN_ISDIR) && isshard(ev->name)) {
+					watchshard(ev->name);
+					/* It may have filled up before it was watched. */
+					rescan = 1;
+				}
+			} else if (ev->len > 0 && ev->wd < MAX_WDS && wdshard[ev->wd][0] && isid(ev->name)) {
+				sprintf(name, "%s/%.*s", wdshard[ev->wd], UNIQNAME_LEN, ev->name);
+				if (!push(name)) rescan = 1;
+			}
+		}
+	}
+	if (n < 0 && errno != EAGAIN) ioerr("read");
+}
+
+void qready(int (*fn)(const char *name))
+{
+	readevents();
+	/* Messages may turn up twice, from an event and from a scan. */
+	if (rescan && !scanning) rescan = 0, scanning = 1;
+	if (scanning) scanning = !scan();
+	while (rlen > 0 && fn(ready[rhead])) {
+		rhead = (rhead + 1) % READY_LEN;
+		--rlen;
+	}
+}
+
+void qrescan(void)
+{
+	rescan = 1;
+}
+
+void qdone(const char *name)
+{
+	char path[QPATH_LEN];
+	/* The envelope goes first, so the message is never half queued. */
+	sprintf(path, ".queue/env/%s", name);
+	if (unlink(path) < 0) ioerr("unlink");
+	sprintf(path, ".queue/msg/%s", name);
+	if (unlink(path) < 0) ioerr("unlink");
+}
+
+/* Writes an envelope for only rcpts of env, and puts it in place at path. */
+static int envstore(const char *path, const struct envelope *env, const char *rcpts[], int nrcpts)
+{
+	char tmp[QPATH_LEN], id[UNIQNAME_LEN+1];
+	uniqname(id);
+	sprintf(tmp, ".queue/tmp/%s", id);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0) return 0;
+	int ok = envwrite(fd, env->format, env->domain, env->sender_local,
+		env->sender_domain, env->body, rcpts, nrcpts);
+	if (close(fd) < 0) ok = 0;
+	/* rename() replaces the old envelope in one step. */
+	if (ok && rename(tmp, path) == 0) return 1;
+	int err = errno;
+	unlink(tmp);
+	errno = err;
+	return 0;
+}
+
+int qdefer(const char *name, const struct envelope *env, const char *rcpts[], int nrcpts)
+{
+	char path[QPATH_LEN];
+	sprintf(path, ".queue/env/%s", name);
+	return envstore(path, env, rcpts, nrcpts);
+}
+
+int qbury(const char *name, const struct envelope *env, const char *rcpts[], int nrcpts)
+{
+	static const char *dirs[] = { ".queue/dead", ".queue/dead/msg", ".queue/dead/env" };
+	char from[QPATH_LEN], path[QPATH_LEN], id[UNIQNAME_LEN+1];
+	for (int d = 0; d < 3; ++d) {
+		if (mkdir(dirs[d], 0700) < 0 && errno != EEXIST) return 0;
+	}
+	/* A message may lose recipients more than once, so every time gets
+	 * its own name. The body is shared with the queue. */
+	uniqname(id);
+	sprintf(from, ".queue/msg/%s", name);
+	sprintf(path, ".queue/dead/msg/%s", id);
+	if (link(from, path) < 0) return 0;
+	sprintf(path, ".queue/dead/env/%s", id);
+	if (envstore(path, env, rcpts, nrcpts)) return 1;
+	int err = errno;
+	sprintf(path, ".queue/dead/msg/%s", id);
+	unlink(path);
+	errno = err;
+	return 0;
+}
@@ -0,0 +1,30 @@
+/* See LICENSE file for copyright and license details. */
+
+/* needs mbox.h, queue.h, env.h */
+
+/* What the programs that deliver mail out of the queue have in common.
+ * Messages are named "XX/ID", as in queue.h. */
+
+/* Long enough for ".queue/env/XX/ID" */
+#define QPATH_LEN 64
+
+/* Starts watching the queue for messages that bmaild publishes. Returns a
+ * descriptor that becomes readable when there are new ones for qready(). */
+int qwatch(void);
+/* Calls fn with the name of every message that turned up since it was last
+ * called, and of every queued message on the first call and whenever events
+ * were lost. If fn returns 0, the message is offered again next time. */
+void qready(int (*fn)(const char *name));
+/* Makes the next qready() go through the whole queue again. Messages that
+ * qdefer() left in the queue only turn up that way. */
+void qrescan(void);
+/* Takes a message out of the queue once it has been delivered. */
+void qdone(const char *name);
+/* Keeps a message queued for only rcpts, which are some of the recipients in
+ * its envelope env. Returns 0 and sets errno if the envelope can't be written. */
+int qdefer(const char *name, const struct envelope *env, const char *rcpts[], int nrcpts);
+/* Sets a copy of a message aside in .queue/dead for only rcpts, which were
+ * rejected for good, as there is no way to bounce it yet. The copy is never
+ * delivered, but stays there for the postmaster. Returns 0 and sets errno if
+ * it can't be made. */
+int qbury(const char *name, const struct envelope *env, const char *rcpts[], int nrcpts);
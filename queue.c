@@ -0,0 +1,32 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "mbox.h"
+#include "queue.h"
+#include "util.h"
+
+int qshard(const char *id, int nshards)
+{
+	/* Good enough, since IDs are partly random anyway. */
+	return fnv1a(id) % nshards;
+}
+
+void qname(char buf[], const char *id, int nshards)
+{
+	sprintf(buf, "%02x/%s", qshard(id, nshards), id);
+}
+
+void mkshards(int nshards)
+{
+	static const char *dirs[] = { "msg", "env" };
+	char path[32];
+	for (int d = 0; d < 2; ++d) {
+		for (int s = 0; s < nshards; ++s) {
+			sprintf(path, ".queue/%s/%02x", dirs[d], s);
+			if (mkdir(path, 0700) < 0 && errno != EEXIST) die("mkdir %s:", path);
+		}
+	}
+}
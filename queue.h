@@ -0,0 +1,34 @@
+/* See LICENSE file for copyright and license details. */
+
+/* needs mbox.h */
+
+/* Layout of the mail queue, relative to the spool directory:
+ *
+ *   .queue/tmp/ID        A message that is still being received, where it
+ *                        can't be kept in an anonymous file instead.
+ *   .queue/msg/XX/ID     The body of a queued message.
+ *   .queue/env/XX/ID     Its envelope, in one of the formats in env.h.
+ *   .queue/dead/msg/ID   A copy of a message for recipients that were
+ *   .queue/dead/env/ID   rejected for good, with an envelope for just them.
+ *                        Nothing delivers these, see qbury().
+ *
+ * ID is a name made by uniqname(), and XX is its shard, the hash qshard()
+ * written as two lowercase hex digits. A message is linked into msg/ before
+ * its envelope appears in env/, so a message is queued exactly when its
+ * envelope exists.
+ *
+ * bmaild creates the shards 00 up to queue_shards - 1 and spreads messages
+ * evenly across them. Consumers should split the work by shard, but must look
+ * into every shard directory that exists, since queue_shards may change.
+ * Older versions queued messages directly in msg/ and env/, see bmailmigrate. */
+
+#define MAX_SHARDS 256
+/* Length of "XX/ID" */
+#define QNAME_LEN (3+UNIQNAME_LEN)
+
+/* Returns which of nshards shards the message with the given ID belongs to. */
+int qshard(const char *id, int nshards);
+/* Writes "XX/ID" for the message with the given ID to buf. */
+void qname(char buf[], const char *id, int nshards);
+/* Creates the directories of the shards 00 up to nshards - 1 if necessary. */
+void mkshards(int nshards);
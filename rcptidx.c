@@ -0,0 +1,178 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+
+#include "smtp.h"
+#include "mbox.h"
+#include "util.h"
+#include "rcptidx.h"
+
+/* How often a lookup retries while the index is being changed,
+ * before it asks the file system instead. */
+#define READ_TRIES 1000
+
+struct entry
+{
+	/* Empty entries have an empty name. */
+	char name[LOCAL_LEN+1];
+	uint32_t hash;
+};
+
+/* An open addressing hash table with linear probing, guarded by a seqlock:
+ * seq is odd while the master changes the table, and readers retry if it
+ * changed while they looked. */
+struct index
+{
+	volatile unsigned seq;
+	/* Set if some mailboxes didn't fit, so lookups can't trust a miss. */
+	int full;
+	uint32_t mask;
+	uint32_t used;
+	uint32_t max;
+	struct entry tab[];
+};
+
+static struct index *idx;
+static int inofd = -1;
+
+/* Finds the entry for name, or the empty one where it belongs. Always
+ * terminates, even on a torn read, because the table is never full. */
+static uint32_t probe(const char *name, uint32_t hash)
+{
+	uint32_t i = hash & idx->mask;
+	while (idx->tab[i].name[0] != '\0') {
+		if (idx->tab[i].hash == hash && strcmp(idx->tab[i].name, name) == 0) break;
+		i = (i + 1) & idx->mask;
+	}
+	return i;
+}
+
+static void insert(const char *name)
+{
+	if (strlen(name) > LOCAL_LEN || !vrfylocal(name)) return;
+	uint32_t hash = fnv1a(name);
+	uint32_t i = probe(name, hash);
+	if (idx->tab[i].name[0] != '\0') return;
+	if (idx->used >= idx->max) {
+		idx->full = 1;
+		return;
+	}
+	idx->tab[i].hash = hash;
+	strcpy(idx->tab[i].name, name);
+	++idx->used;
+}
+
+static void delete(const char *name)
+{
+	if (strlen(name) > LOCAL_LEN) return;
+	uint32_t i = probe(name, fnv1a(name)), j = i;
+	if (idx->tab[i].name[0] == '\0') return;
+	/* Move later entries of the same cluster back, so that no probe
+	 * sequence gets cut short by the hole we leave. */
+	for (;;) {
+		j = (j + 1) & idx->mask;
+		if (idx->tab[j].name[0] == '\0') break;
+		uint32_t home = idx->tab[j].hash & idx->mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+		idx->tab[i] = idx->tab[j];
+		i = j;
+	}
+	memset(&idx->tab[i], 0, sizeof(idx->tab[i]));
+	--idx->used;
+}
+
+static void build(void)
+{
+	DIR *dir;
+	struct dirent *de;
+	memset(idx->tab, 0, (idx->mask + 1) * sizeof(idx->tab[0]));
+	idx->used = 0;
+	idx->full = 0;
+	if ((dir = opendir(".")) == NULL) die("opendir:");
+	while ((de = readdir(dir)) != NULL) {
+		insert(de->d_name);
+	}
+	closedir(dir);
+}
+
+static void wbegin(void)
+{
+	++idx->seq;
+	__sync_synchronize();
+}
+
+static void wend(void)
+{
+	__sync_synchronize();
+	++idx->seq;
+}
+
+void idxinit(int max)
+{
+	/* Keep the table at most half full. */
+	uint32_t size = 16;
+	while (size < 2 * (uint32_t) max) size *= 2;
+	size_t len = sizeof(*idx) + size * sizeof(idx->tab[0]);
+	idx = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (idx == MAP_FAILED) die("mmap:");
+	idx->mask = size - 1;
+	idx->max = max;
+	build();
+}
+
+int idxwatch(void)
+{
+	if ((inofd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) die("inotify_init1:");
+	if (inotify_add_watch(inofd, ".", IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0)
+		die("inotify_add_watch:");
+	return inofd;
+}
+
+void idxupdate(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while ((len = read(inofd, buf, sizeof(buf))) > 0) {
+		wbegin();
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *) p;
+			p += sizeof(*ev) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				build();
+			} else if (ev->len == 0) {
+				continue;
+			} else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+				insert(ev->name);
+			} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				delete(ev->name);
+			}
+		}
+		wend();
+	}
+	if (len < 0 && errno != EAGAIN) ioerr("read");
+}
+
+int idxlookup(const char *name)
+{
+	if (idx == NULL) return vrfylocal(name);
+	if (strlen(name) > LOCAL_LEN) return 0;
+	uint32_t hash = fnv1a(name);
+	for (int t = 0; t < READ_TRIES; ++t) {
+		unsigned seq = idx->seq;
+		if (seq & 1) continue;
+		__sync_synchronize();
+		int found = idx->tab[probe(name, hash)].name[0] != '\0';
+		int full = idx->full;
+		__sync_synchronize();
+		if (idx->seq != seq) continue;
+		return found || (full && vrfylocal(name));
+	}
+	return vrfylocal(name);
+}
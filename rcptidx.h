@@ -0,0 +1,16 @@
+/* See LICENSE file for copyright and license details. */
+
+/* An index of the mailboxes in the spool, so that recipients can be checked
+ * without a system call. It lives in memory that is shared by all processes:
+ * The master keeps it current through inotify, and the workers only read it. */
+
+/* Builds the index from the spool, which must be the current directory, with
+ * room for max mailboxes. Has to be called before any workers are forked. */
+void idxinit(int max);
+/* Starts watching the spool for changes. Returns a file descriptor that
+ * becomes readable whenever idxupdate() has something to do. */
+int idxwatch(void);
+/* Applies the changes to the spool that inotify has reported. */
+void idxupdate(void);
+/* Checks whether a mailbox of the given name exists, like vrfylocal(). */
+int idxlookup(const char *name);
@@ -0,0 +1,112 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "util.h"
+#include "rcptset.h"
+
+#define FIRST_TAB 16
+
+static unsigned long domainhash(const char *name)
+{
+	/* FNV-1a, but on the lower case name. */
+	uint32_t h = 2166136261u;
+	for (const char *c = name; *c; ++c) {
+		h ^= (unsigned char) tolower((unsigned char) *c);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static unsigned long rcpthash(const char *local, const struct domain *d)
+{
+	return (fnv1a(local) ^ d->hash * 2654435761u) & 0xFFFFFFFF;
+}
+
+/* Makes sure that a table with n entries is at most half full afterwards.
+ * The old table is left to the arena. */
+static int grow(struct arena *a, void ***tab, unsigned long *mask, int n,
+	unsigned long (*hashof)(const void *))
+{
+	if (*tab != NULL && 2 * (unsigned long) n <= *mask) return 1;
+	unsigned long size = *tab != NULL ? 2 * (*mask + 1) : FIRST_TAB;
+	void **new = aralloc(a, size * sizeof(new[0]));
+	if (new == NULL) return 0;
+	memset(new, 0, size * sizeof(new[0]));
+	if (*tab != NULL) {
+		for (unsigned long i = 0; i <= *mask; ++i) {
+			if ((*tab)[i] == NULL) continue;
+			unsigned long j = hashof((*tab)[i]) & (size - 1);
+			while (new[j] != NULL) j = (j + 1) & (size - 1);
+			new[j] = (*tab)[i];
+		}
+	}
+	*tab = new;
+	*mask = size - 1;
+	return 1;
+}
+
+static unsigned long hashofdomain(const void *d)
+{
+	return ((const struct domain *) d)->hash;
+}
+
+static unsigned long hashofrcpt(const void *r)
+{
+	return ((const struct rcpt *) r)->hash;
+}
+
+static struct domain *getdomain(struct rcptset *rs, struct arena *a, const char *name)
+{
+	unsigned long hash = domainhash(name), i;
+	if (!grow(a, &rs->dtab, &rs->dmask, rs->ndomains + 1, hashofdomain)) return NULL;
+	for (i = hash & rs->dmask; rs->dtab[i] != NULL; i = (i + 1) & rs->dmask) {
+		struct domain *d = rs->dtab[i];
+		if (d->hash == hash && strcasecmp(d->name, name) == 0) return d;
+	}
+	struct domain *d = aralloc(a, sizeof(*d));
+	if (d == NULL || (d->name = arstrdup(a, name)) == NULL) return NULL;
+	d->rcpts = NULL;
+	d->tail = &d->rcpts;
+	d->nrcpts = 0;
+	d->next = NULL;
+	d->hash = hash;
+	*rs->tail = d;
+	rs->tail = &d->next;
+	++rs->ndomains;
+	rs->dtab[i] = d;
+	return d;
+}
+
+void rsclear(struct rcptset *rs)
+{
+	memset(rs, 0, sizeof(*rs));
+	rs->tail = &rs->domains;
+}
+
+int rsadd(struct rcptset *rs, struct arena *a, const char *local, const char *domain)
+{
+	struct domain *d = getdomain(rs, a, domain);
+	if (d == NULL) return -1;
+	unsigned long hash = rcpthash(local, d), i;
+	if (!grow(a, &rs->rtab, &rs->rmask, rs->nrcpts + 1, hashofrcpt)) return -1;
+	for (i = hash & rs->rmask; rs->rtab[i] != NULL; i = (i + 1) & rs->rmask) {
+		struct rcpt *r = rs->rtab[i];
+		if (r->hash == hash && r->domain == d && strcmp(r->local, local) == 0) return 0;
+	}
+	struct rcpt *r = aralloc(a, sizeof(*r));
+	if (r == NULL || (r->local = arstrdup(a, local)) == NULL) return -1;
+	r->domain = d;
+	r->next = NULL;
+	r->hash = hash;
+	*d->tail = r;
+	d->tail = &r->next;
+	++d->nrcpts;
+	++rs->nrcpts;
+	rs->rtab[i] = r;
+	return 1;
+}
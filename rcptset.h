@@ -0,0 +1,46 @@
+/* See LICENSE file for copyright and license details. */
+
+/* needs arena.h */
+
+/* The recipients of a transaction, grouped by domain in the order in which the
+ * domains first came up. Adding a recipient that is already there is noticed
+ * right away through hash tables, so no sorting is needed afterwards. */
+
+struct rcpt
+{
+	const char *local;
+	struct domain *domain;
+	struct rcpt *next;
+	unsigned long hash;
+};
+
+struct domain
+{
+	const char *name;
+	struct rcpt *rcpts;
+	struct rcpt **tail;
+	int nrcpts;
+	struct domain *next;
+	unsigned long hash;
+};
+
+struct rcptset
+{
+	struct domain *domains;
+	struct domain **tail;
+	int ndomains;
+	int nrcpts;
+	/* Open addressing hash tables of domains and recipients,
+	 * which live in the arena. */
+	void **dtab;
+	unsigned long dmask;
+	void **rtab;
+	unsigned long rmask;
+};
+
+/* Empties the set. Its memory is released by resetting its arena. */
+void rsclear(struct rcptset *rs);
+/* Adds local@domain, copying both into the arena. Domains are compared
+ * without regard to case. Returns 1 if the recipient was added, 0 if it was
+ * already there, and -1 if the arena ran out of memory. */
+int rsadd(struct rcptset *rs, struct arena *a, const char *local, const char *domain);
@@ -1,21 +1,53 @@
 /* See LICENSE file for copyright and license details. */
 
+#define _GNU_SOURCE /* for splice() */
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <poll.h>
 
 #include <tls.h>
 
 #include "conn.h"
 #include "mbox.h"
 #include "smtp.h"
+#include "queue.h"
+#include "env.h"
+#include "rcptidx.h"
+#include "arena.h"
+#include "rcptset.h"
+#include "stats.h"
 #include "util.h"
+#include "peers.h"
+#include "recv.h"
+
+/* How many commands or DATA chunks a session may process in one go
+ * before it has to yield to the other sessions of its process. */
+#define STEP_BUDGET 64
+/* How many pieces of body data acdata() gathers before writing them out. */
+#define SPOOL_IOVS 64
+/* The size of the buffer that a pipe gets drained into after a failed splice. */
+#define SPLICE_DRAIN 4096
+/* Longest path of a file in the queue, relative to the spool. */
+#define QPATH_LEN 64
+/* How many ended sessions to keep around for reuse. */
+#define SPARE_SESSIONS 64
 
 extern char my_domain[256];
+extern int splice_data;
+extern int durability;
+extern int queue_shards;
+extern int envelope_format;
 
 struct tstat
 {
@@ -26,48 +58,209 @@ struct tstat
 	char cl_domain[DOMAIN_LEN+1];
 };
 
+/* Where the time of a session went, in microseconds. Only kept while tracing. */
+struct trace
+{
+	unsigned long greeting;
+	unsigned long tls;
+	unsigned long commands;
+	unsigned long cmdtime;
+	unsigned long body;
+	unsigned long bodybytes;
+	unsigned long commit;
+};
+
 struct addr
 {
-	char *local;
-	char *domain;
+	const char *local;
+	const char *domain;
+};
+
+enum {
+	S_COMMAND,
+	S_DATA,
+	S_CHUNK,
+	S_COMMIT,
+	S_QUIT,
+};
+
+struct session
+{
+	struct conn conn;
+	int state;
+	struct tstat tstat;
+	/* Holds everything that belongs to the current transaction. */
+	struct arena arena;
+	struct addr sender;
+	struct rcptset rcpts;
+	int body;
+	/* Did the last EHLO offer STARTTLS? */
+	int tlsoffered;
+	/* DATA and BDAT reception */
+	int datafd;
+	int dataerr;
+	/* Is the next body byte at the beginning of a line? */
+	int bol;
+	/* What is left of the current BDAT chunk, and is it the last one? */
+	unsigned long chunkleft;
+	int chunklast;
+	/* Only set if the message file has a name before it is published. */
+	char tmp_msg[QPATH_LEN];
+	/* The queue names that the current message got so far, which are taken
+	 * out again if it doesn't become durable. */
+	const char **published;
+	int npublished;
+	/* The recvsync() generation that makes the last message durable. */
+	unsigned long commitgen;
+	/* Body bytes written to the queue for the current message. */
+	unsigned long spooled;
+	/* When the session started, and when the current message was complete. */
+	unsigned long started;
+	unsigned long committing;
+	/* When phases that span several steps started, while tracing. */
+	unsigned long tlsstart;
+	unsigned long bodystart;
+	struct trace trace;
 };
 
-static struct tstat *tstat;
-static struct addr sender;
-static struct addr *rcpts = NULL;
-static int nrcpts;
-static int crcpts;
+/* The session that is currently being processed. */
+static struct session *ss;
+static struct session *spare[SPARE_SESSIONS];
+static int nspare;
+/* Shared by all sessions of the process for spooling with splice(). */
+static int splice_pipe[2] = { -1, -1 };
+/* The queue directory, kept open for syncing the spool. */
+static int queuefd = -1;
+/* How many syncs recvsync() has started, how many are done, and the last one
+ * that failed. */
+static unsigned long syncstarted, syncgen, syncfail;
+/* The pipes to and from the process that runs the syncs, if there is one. */
+static int syncreq = -1, syncdone = -1;
+/* Which ways of creating and publishing queue files turned out to work.
+ * For tmpfile_ok, -1 means that this hasn't been tried yet. */
+static int tmpfile_ok = -1, emptypath_ok = 1;
+
+/* Gives a file created with qcreate() the name path in the queue. */
+static int qpublish(int fd, const char tmp[], const char *path)
+{
+	if (tmp[0] != '\0') return link(tmp, path) == 0;
+	/* Linking an open file directly needs CAP_DAC_READ_SEARCH
+	 * on older kernels, which we dropped along with root. */
+	if (emptypath_ok) {
+		if (linkat(fd, "", AT_FDCWD, path, AT_EMPTY_PATH) == 0) return 1;
+		if (errno != ENOENT && errno != EPERM) return 0;
+		emptypath_ok = 0;
+	}
+	char proc[32];
+	sprintf(proc, "/proc/self/fd/%d", fd);
+	return linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0;
+}
+
+/* Checks whether anonymous files can be published at all. That is not the
+ * case if the filesystem lacks O_TMPFILE, or if we may neither link them
+ * directly nor see /proc from within our chroot. */
+static int probetmpfile(void)
+{
+	char path[QPATH_LEN], name[UNIQNAME_LEN+1];
+	int fd, ok;
+	if ((fd = open(".queue/tmp", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600)) < 0) return 0;
+	uniqname(name);
+	sprintf(path, ".queue/tmp/%s", name);
+	if ((ok = qpublish(fd, "", path))) unlink(path);
+	close(fd);
+	return ok;
+}
+
+/* Creates a file in the queue directory dir that stays invisible until it is
+ * published with qpublish(), and vanishes if we crash before that. Where that
+ * isn't possible, a named file in tmp/ is used instead, and its name is stored
+ * in tmp. Otherwise, tmp is left empty. */
+static int qcreate(const char *dir, char tmp[])
+{
+	int fd;
+	tmp[0] = '\0';
+	if (tmpfile_ok < 0) tmpfile_ok = probetmpfile();
+	if (tmpfile_ok) {
+		if ((fd = open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600)) >= 0) return fd;
+		if (errno != EOPNOTSUPP && errno != EISDIR) return -1;
+		tmpfile_ok = 0;
+	}
+	char name[UNIQNAME_LEN+1];
+	uniqname(name);
+	sprintf(tmp, ".queue/tmp/%s", name);
+	return open(tmp, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+}
+
+/* Creates the file that the message body is spooled to. */
+static int opendata(void)
+{
+	if ((ss->datafd = qcreate(".queue/msg", ss->tmp_msg)) < 0) {
+		ioerr("open");
+		ss->dataerr = 1;
+		return 0;
+	}
+	ss->dataerr = 0;
+	return 1;
+}
+
+/* Closes the message file, and throws it away unless it has been published. */
+static void dropdata(void)
+{
+	if (ss->datafd < 0) return;
+	close(ss->datafd);
+	ss->datafd = -1;
+	if (ss->tmp_msg[0] != '\0') unlink(ss->tmp_msg);
+}
 
 static void reset(void)
 {
-	memset(sender.local, 0, LOCAL_LEN + 1);
-	memset(sender.domain, 0, DOMAIN_LEN + 1);
-	for (int i = 0; i < nrcpts; ++i)
-		free(rcpts[i].local);
-	free(rcpts);
-	rcpts = NULL;
-	nrcpts = 0;
-	crcpts = 0;
+	dropdata();
+	ss->dataerr = 0;
+	ss->spooled = 0;
+	ss->bodystart = 0;
+	ss->body = BODY_7BIT;
+	arreset(&ss->arena);
+	ss->published = NULL;
+	ss->npublished = 0;
+	ss->sender.local = "";
+	ss->sender.domain = "";
+	rsclear(&ss->rcpts);
+}
+
+/* Appends a reply, or the first part of one, and counts its status code. */
+static void reply(char *text)
+{
+	if (text[3] == ' ') {
+		int code = (text[0] - '0') * 100 + (text[1] - '0') * 10 + (text[2] - '0');
+		if (code < MAX_CODE) STATINC(stats->replies[code]);
+	}
+	cwritent(text);
 }
 
 static void dohelo(int ext)
 {
 	char domain[DOMAIN_LEN+1];
 	if (phelo(domain)) {
-		strcpy(tstat->cl_domain, domain);
-		if (ext && cntls != NULL) {
-			cwritent("250-");
+		strcpy(ss->tstat.cl_domain, domain);
+		ss->tlsoffered = ext && cn->tls != NULL && cn->read != cread_tls;
+		if (ext) {
+			reply("250-");
 			cwritent(my_domain);
 			cwritent(" Hi\r\n");
-			cwritent("250 STARTTLS\r\n");
+			if (ss->tlsoffered)
+				reply("250-STARTTLS\r\n");
+			reply("250-8BITMIME\r\n");
+			reply("250-BINARYMIME\r\n");
+			reply("250-CHUNKING\r\n");
+			reply("250 PIPELINING\r\n");
 		} else {
-			cwritent("250 ");
+			reply("250 ");
 			cwritent(my_domain);
 			cwritent(" Hi\r\n");
 		}
 	} else {
-		cwritent("501 Syntax Error\r\n");
-		++tstat->total_viols;
+		reply("501 Syntax Error\r\n");
+		++ss->tstat.total_viols;
 	}
 }
 
@@ -75,14 +268,22 @@ static void domail(void)
 {
 	char local[LOCAL_LEN+1];
 	char domain[DOMAIN_LEN+1];
-	if (pmail(local, domain)) {
-		strcpy(sender.local, local);
-		strcpy(sender.domain, domain);
-		++tstat->total_trans;
-		cwritent("250 OK\r\n");
+	int body;
+	if (pmail(local, domain, &body)) {
+		const char *l = arstrdup(&ss->arena, local);
+		const char *d = arstrdup(&ss->arena, domain);
+		if (l == NULL || d == NULL) {
+			reply("450 Insufficient RAM\r\n");
+			return;
+		}
+		ss->body = body;
+		ss->sender.local = l;
+		ss->sender.domain = d;
+		++ss->tstat.total_trans;
+		reply("250 OK\r\n");
 	} else {
-		cwritent("501 Syntax Error\r\n");
-		++tstat->total_viols;
+		reply("501 Syntax Error\r\n");
+		++ss->tstat.total_viols;
 	}
 }
 
@@ -92,218 +293,729 @@ static void dorcpt(void)
 	char domain[DOMAIN_LEN+1];
 
 	if (!prcpt(local, domain)) {
-		cwritent("501 Syntax Error\r\n");
-		++tstat->total_viols;
+		reply("501 Syntax Error\r\n");
+		++ss->tstat.total_viols;
 		return;
 	}
-
-	if (nrcpts + 1 > crcpts) {
-		int cap = crcpts == 0 ? 16 : 2 * crcpts;
-		void *mem = reallocarray(rcpts, cap, sizeof(rcpts[0]));
-		if (mem == NULL) {
-			cwritent("450 Insufficient RAM\r\n"); /* FIXME is this the right status code? */
-			return;
-		}
-		rcpts = mem;
-		crcpts = cap;
+	if (strcasecmp(domain, my_domain) == 0 && !idxlookup(local)) {
+		reply("550 No such Mailbox\r\n");
+		++ss->tstat.total_viols;
+		return;
 	}
 
-	size_t local_len = strlen(local);
-	size_t domain_len = strlen(domain);
-	struct addr addr;
-	addr.local = malloc(local_len + domain_len + 2);
-	if (addr.local == NULL) {
-		cwritent("450 Insufficient RAM\r\n"); /* FIXME is this the right status code? */
+	switch (rsadd(&ss->rcpts, &ss->arena, local, domain)) {
+	case -1:
+		reply("450 Insufficient RAM\r\n"); /* FIXME is this the right status code? */
+		return;
+	case 0:
+		/* Already there, nothing to do. */
+		reply("250 OK\r\n");
 		return;
 	}
-	addr.domain = addr.local + local_len + 1;
-	strcpy(addr.local, local);
-	strcpy(addr.domain, domain);
-	rcpts[nrcpts++] = addr;
 
-	++tstat->total_rcpts;
-	cwritent("250 OK\r\n");
+	++ss->tstat.total_rcpts;
+	reply("250 OK\r\n");
 }
 
-static void acdata(int fd)
+/* Writes out body data, giving up on the message if the file system fails us. */
+static void spool(struct iovec *iov, int n)
 {
-	char inb[512], outb[512];
-	int inc = 0, ini = 0, outc = 0, match = 0;
-	for (;;) {
-		if (ini >= inc) {
-			inc = cread(inb, sizeof(inb));
-			ini = 0;
+	while (n > 0 && !ss->dataerr) {
+		ssize_t w = writev(ss->datafd, iov, n);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			ioerr("writev");
+			ss->dataerr = 1;
+			break;
+		}
+		ss->spooled += w;
+		while (n > 0 && (size_t) w >= iov->iov_len) {
+			w -= iov->iov_len;
+			++iov, --n;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+}
+
+/* Sets up spooling with splice() for the current connection if possible. */
+static int cansplice(void)
+{
+	if (!splice_data || cn->read != cread_plain || ss->dataerr) return 0;
+	if (splice_pipe[0] < 0) {
+		if (pipe2(splice_pipe, O_CLOEXEC) < 0) {
+			ioerr("pipe2");
+			splice_data = 0;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Throws away len bytes that are stuck in the pipe, so that it can be reused.
+ * If that fails, the pipe is replaced by a new one. Returns 0 in that case. */
+static int acdrain(size_t len)
+{
+	char buf[SPLICE_DRAIN];
+	while (len > 0) {
+		ssize_t n = read(splice_pipe[0], buf, len < sizeof(buf) ? len : sizeof(buf));
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			ioerr("read");
+			close(splice_pipe[0]);
+			close(splice_pipe[1]);
+			splice_pipe[0] = splice_pipe[1] = -1;
+			return 0;
 		}
-		if (outc + 4 > (int) sizeof(outb)) {
-			write(fd, outb, outc); /* TODO error checking & resume after partial write */
-			outc = 0;
+		len -= n;
+	}
+	return 1;
+}
+
+/* Moves up to len bytes that are waiting on the socket into the message file
+ * through a pipe, without copying them into user space. Returns how many
+ * bytes were moved. */
+static size_t acmove(size_t len)
+{
+	size_t left = len;
+	while (left > 0) {
+		ssize_t in = splice(cn->sock, NULL, splice_pipe[1], NULL, left,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (in <= 0) {
+			if (in < 0 && errno == EINVAL) splice_data = 0;
+			break;
 		}
-		if (inb[ini] == "\r\n.\r\n"[match]) {
-			if (++match == 5) {
-				write(fd, outb, outc); /* TODO error checking & resume after partial write */
-				return;
+		left -= in;
+		while (in > 0) {
+			ssize_t out = -1;
+			if (!ss->dataerr) {
+				out = splice(splice_pipe[0], NULL, ss->datafd, NULL, in, SPLICE_F_MOVE);
 			}
-		} else {
-			switch (match) {
-			case 1: memcpy(outb+outc, "\r", 1), outc += 1; break;
-			case 2: memcpy(outb+outc, "\r\n", 2), outc += 2; break;
-			case 3: memcpy(outb+outc, "\r\n", 2), outc += 2; break;
-			case 4: memcpy(outb+outc, "\r\n\r", 3), outc += 3; break;
+			if (out < 0 && errno == EINTR) continue;
+			if (out <= 0) {
+				if (!ss->dataerr) ioerr("splice");
+				ss->dataerr = 1;
+				if (!acdrain(in)) return len - left;
+				out = in;
+			} else {
+				ss->spooled += out;
 			}
-			outb[outc++] = inb[ini];
-			match = 0;
+			in -= out;
 		}
-		++ini;
 	}
+	return len - left;
 }
 
+/* Receives the next piece of a BDAT chunk. Its length is known up front, so
+ * the data needs no scanning at all. Returns 1 once the chunk is complete,
+ * 0 if more of it has been received, and -1 if no input is available. */
+static int acchunk(void)
+{
+	size_t n = cn->intail - cn->inhead;
+	if (ss->chunkleft == 0) return 1;
+	if (n > 0) {
+		if (n > ss->chunkleft) n = ss->chunkleft;
+		struct iovec iov = { .iov_base = cn->in + cn->inhead, .iov_len = n };
+		spool(&iov, 1);
+		cn->inhead += n;
+	} else if (!(cflush() && cansplice() && (n = acmove(ss->chunkleft)) > 0)) {
+		return cfill() > 0 ? 0 : -1;
+	}
+	ss->chunkleft -= n;
+	return ss->chunkleft == 0;
+}
 
-static int addrcmp(const void *p1, const void *p2)
+/* Receives the message body that is in the input buffer, removing any
+ * dot-stuffing (RFC 5321, 4.5.2) on the way. Clean runs between dotted lines
+ * are spooled straight out of the buffer. Returns 1 once the end of the body
+ * has been reached, 0 if more input has been read, and -1 if none is available. */
+static int acdata(void)
 {
-	const struct addr a1 = *(const struct addr *) p1;
-	const struct addr a2 = *(const struct addr *) p2;
-	int c = strcmp(a1.domain, a2.domain);
-	if (c) return c;
-	c = strcmp(a1.local, a2.local);
-	return c;
+	struct iovec iov[SPOOL_IOVS];
+	int niov = 0, done = 0;
+	char *start = cn->in + cn->inhead;
+	char *end = cn->in + cn->intail;
+	char *p = start;
+	for (;;) {
+		if (ss->bol) {
+			if (p == end) break;
+			if (*p == '.') {
+				/* Wait for enough input to tell ".\r\n" from a stuffed dot. */
+				if (end - p < 3) break;
+				if (p[1] == '\r' && p[2] == '\n') {
+					p += 3, done = 1;
+					break;
+				}
+				++p;
+			}
+			ss->bol = 0;
+		}
+		const char *crlf = dotscan(p, end);
+		char *stop;
+		if (crlf != NULL) {
+			stop = (char *) crlf + 2;
+			ss->bol = 1;
+		} else if (end - p >= 2 && end[-2] == '\r' && end[-1] == '\n') {
+			stop = end;
+			ss->bol = 1;
+		} else {
+			/* A trailing CR might be the start of a CR LF. */
+			stop = end - (p < end && end[-1] == '\r');
+		}
+		if (stop > p) {
+			iov[niov].iov_base = p;
+			iov[niov].iov_len = stop - p;
+			if (++niov == SPOOL_IOVS) {
+				spool(iov, niov);
+				niov = 0;
+			}
+		}
+		p = stop;
+		if (crlf == NULL) break;
+	}
+	spool(iov, niov);
+	cn->inhead = p - cn->in;
+	if (done) return 1;
+	if (p != start) return 0;
+	return cfill() > 0 ? 0 : -1;
 }
 
-/* FIXME This entire function doesn't do error handling! */
+
 static void dodata(void)
 {
 	if (!pcrlf()) {
-		cwritent("501 Syntax Error\r\n");
-		++tstat->total_viols;
+		reply("501 Syntax Error\r\n");
+		++ss->tstat.total_viols;
+		return;
+	}
+	/* DATA can't carry binary bodies, nor finish a BDAT transfer. */
+	if (ss->datafd >= 0 || ss->body == BODY_BINARYMIME) {
+		reply("503 Bad Sequence\r\n");
+		++ss->tstat.total_viols;
+		return;
+	}
+	/* A pipelining client sends DATA before it knows how its RCPTs fared. */
+	if (ss->rcpts.nrcpts == 0) {
+		reply("554 No valid Recipients\r\n");
+		return;
+	}
+	if (!opendata()) {
+		reply("451 Local Error\r\n");
+		return;
 	}
-	cwritent("354 Listening\r\n");
-	chdir(".queue");
+	reply("354 Listening\r\n");
+	ss->bodystart = TSTART();
+	ss->bol = 1;
+	ss->state = S_DATA;
+}
 
-	char tmp_msg[32], tmp_env[32];
-	sprintf(tmp_msg, "tmp/%d.msg", getpid());
-	sprintf(tmp_env, "tmp/%d.env", getpid());
+static void dobdat(void)
+{
+	unsigned long size;
+	int last;
+	if (!pbdat(&size, &last)) {
+		reply("501 Syntax Error\r\n");
+		++ss->tstat.total_viols;
+		return;
+	}
+	/* The chunk has to be read even if it can't be stored,
+	 * or if there is nobody to deliver it to. */
+	if (ss->rcpts.nrcpts == 0) ss->dataerr = 1;
+	else if (ss->datafd < 0 && !ss->dataerr) opendata();
+	if (ss->bodystart == 0) ss->bodystart = TSTART();
+	ss->chunkleft = size;
+	ss->chunklast = last;
+	ss->state = S_CHUNK;
+}
 
-	int datafd = open(tmp_msg, O_CREAT | O_WRONLY);
-	acdata(datafd);
-	close(datafd);
+/* Makes the directory entries of a message in the given shard durable
+ * if every message is synced on its own. */
+static int syncshard(int shard)
+{
+	static const char *dirs[] = { "msg", "env" };
+	char path[QPATH_LEN];
+	if (durability != DUR_MESSAGE) return 1;
+	for (int d = 0; d < 2; ++d) {
+		sprintf(path, ".queue/%s/%02x", dirs[d], shard);
+		int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0 || fsync(fd) < 0) {
+			ioerr("fsync");
+			if (fd >= 0) close(fd);
+			return 0;
+		}
+		close(fd);
+	}
+	return 1;
+}
 
-	qsort(rcpts, nrcpts, sizeof(rcpts[0]), addrcmp);
+/* Makes the contents of a file durable if every message is synced on its own. */
+static int syncfile(int fd)
+{
+	if (durability != DUR_MESSAGE) return 1;
+	if (fdatasync(fd) < 0) {
+		ioerr("fdatasync");
+		return 0;
+	}
+	return 1;
+}
 
-	int i = 0;
-	while (i < nrcpts) {
-		FILE *envf = fopen(tmp_env, "w");
+/* Takes the current message out of the queue again, since the client is told
+ * to send it once more. Delivery may have got to some of it already. */
+static void unpublish(void)
+{
+	char path[QPATH_LEN];
+	for (int i = 0; i < ss->npublished; ++i) {
+		/* The envelope goes first, so the message is never half queued. */
+		sprintf(path, ".queue/env/%s", ss->published[i]);
+		if (unlink(path) < 0 && errno != ENOENT) ioerr("unlink");
+		sprintf(path, ".queue/msg/%s", ss->published[i]);
+		if (unlink(path) < 0 && errno != ENOENT) ioerr("unlink");
+	}
+	ss->npublished = 0;
+}
 
-		struct stat info;
-		stat(tmp_env, &info);
-		char prm_msg[32], prm_env[32];
-		sprintf(prm_msg, "msg/%lu", info.st_ino);
-		sprintf(prm_env, "env/%lu", info.st_ino);
+/* Lists the local parts of the recipients at domain d. */
+static void domainrcpts(const char *locals[], const struct domain *d)
+{
+	int n = 0;
+	for (const struct rcpt *r = d->rcpts; r != NULL; r = r->next) {
+		locals[n++] = r->local;
+	}
+}
 
-		char *domain = rcpts[i].domain;
-		fprintf(envf, "bq1\n%s\n%s\n%s\n--\n",
-			domain, sender.local, sender.domain);
+/* Answers the client once the current message is durable, or has failed to
+ * become so. */
+static void endcommit(int ok)
+{
+	if (ok) {
+		STATINC(stats->counters[ST_MESSAGES]);
+		STATADD(stats->counters[ST_BYTES], ss->spooled);
+	} else {
+		/* The client sends it again, so it mustn't be delivered. */
+		unpublish();
+	}
+	reset();
+	ss->state = S_COMMAND;
+	reply(ok ? "250 OK\r\n" : "451 Local Error\r\n");
+	ss->trace.commit += stathist(&stats->hists[H_COMMIT], ss->committing);
+}
 
-		fprintf(envf, "%s\n", rcpts[i++].local);
-		while (i < nrcpts) {
-			if (strcmp(rcpts[i].domain, domain) != 0) break;
-			if (strcmp(rcpts[i].local, rcpts[i-1].local) != 0) {
-				fprintf(envf, "%s\n", rcpts[i].local);
-			}
-			++i;
-		}
+/* Publishes the received message once for every recipient domain. The message
+ * file gets linked into msg/ and the envelope into env/ under the same name,
+ * which is the only metadata work that has to be done per envelope. */
+static void enddata(void)
+{
+	char tmp_env[QPATH_LEN], path[QPATH_LEN];
+	char id[UNIQNAME_LEN+1], name[QNAME_LEN+1];
+	const char **locals = NULL;
+	const struct domain *d = ss->rcpts.domains;
+	ss->committing = statclock();
+	if (TRACING) {
+		ss->trace.body += stathist(&stats->hists[H_BODY], ss->bodystart);
+		ss->trace.bodybytes += ss->spooled;
+	}
+	int ok = !ss->dataerr && syncfile(ss->datafd);
+	ss->state = S_COMMAND;
 
-		fclose(envf);
-		link(tmp_msg, prm_msg);
-		rename(tmp_env, prm_env);
+	if (ok && ((locals = aralloc(&ss->arena, ss->rcpts.nrcpts * sizeof(locals[0]))) == NULL ||
+	    (ss->published = aralloc(&ss->arena, ss->rcpts.ndomains * sizeof(ss->published[0]))) == NULL)) {
+		ioerr("aralloc");
+		ok = 0;
 	}
-	unlink(tmp_msg);
 
-	chdir("..");
-	reset();
-	cwritent("250 OK\r\n");
+	for (; ok && d != NULL; d = d->next) {
+		domainrcpts(locals, d);
+		unsigned long start = TSTART();
+		int envfd = qcreate(".queue/env", tmp_env);
+		if (envfd < 0) {
+			ioerr("open");
+			ok = 0;
+			break;
+		}
+		if (!envwrite(envfd, envelope_format, d->name, ss->sender.local,
+		    ss->sender.domain, ss->body, locals, d->nrcpts) || !syncfile(envfd)) {
+			ioerr("write");
+			ok = 0;
+		}
+		(void) TSTOP(&stats->hists[H_ENVELOPE], start);
+		start = TSTART();
+		uniqname(id);
+		qname(name, id, queue_shards);
+		sprintf(path, ".queue/msg/%s", name);
+		if (ok && !qpublish(ss->datafd, ss->tmp_msg, path)) {
+			ioerr("link");
+			ok = 0;
+		}
+		if (ok && (ss->published[ss->npublished] = arstrdup(&ss->arena, name)) == NULL) {
+			ioerr("arstrdup");
+			unlink(path);
+			ok = 0;
+		}
+		if (ok) ++ss->npublished;
+		sprintf(path, ".queue/env/%s", name);
+		if (ok && !qpublish(envfd, tmp_env, path)) {
+			ioerr("link");
+			ok = 0;
+		}
+		if (ok && !syncshard(qshard(id, queue_shards))) ok = 0;
+		(void) TSTOP(&stats->hists[H_PUBLISH], start);
+		close(envfd);
+		if (tmp_env[0] != '\0') unlink(tmp_env);
+	}
+
+	if (!ok) {
+		/* A message that is only partly queued would be delivered twice. */
+		unpublish();
+		reset();
+		reply("451 Local Error\r\n");
+		ss->trace.commit += stathist(&stats->hists[H_COMMIT], ss->committing);
+		return;
+	}
+	if (durability == DUR_GROUP) {
+		/* The reply has to wait for the next recvsync(), and the message
+		 * is kept in mind until then. */
+		ss->commitgen = syncstarted + 1;
+		ss->state = S_COMMIT;
+		return;
+	}
+	endcommit(1);
 }
 
-void recvmail(void)
+static void command(char *line, int len)
 {
-	struct tstat tstat_buf;
-	char sender_local_buf[LOCAL_LEN + 1];
-	char sender_domain_buf[DOMAIN_LEN + 1];
-	char line[COMMAND_LEN];
-
-	tstat = &tstat_buf;
-	memset(tstat, 0, sizeof(*tstat));
-	tstat->start_time = time(NULL);
-	strcpy(tstat->cl_domain, "<DOMAIN UNKNOWN>");
+	unsigned long start = TSTART();
+	if (ss->tlsstart != 0) {
+		ss->trace.tls = TSTOP(&stats->hists[H_TLS], ss->tlsstart);
+		ss->tlsstart = 0;
+	}
+	cphead = line;
+	cpend = line + len;
+	int verb = pverb(len);
+	STATINC(stats->verbs[verb]);
+	switch (verb) {
+	case VERB_HELO:
+		dohelo(0);
+		break;
+	case VERB_EHLO:
+		dohelo(1);
+		break;
+	case VERB_STARTTLS:
+		if (!pcrlf()) {
+			reply("501 Syntax Error\r\n");
+			++ss->tstat.total_viols;
+		} else if (cn->tls == NULL || cn->read == cread_tls || cn->starttls) {
+			/* Not offered, or already done. */
+			reply("502 Command not Implemented\r\n");
+			++ss->tstat.total_viols;
+		} else if (!ss->tlsoffered) {
+			/* Only an EHLO tells the client that it is there. */
+			reply("503 Bad Sequence\r\n");
+			++ss->tstat.total_viols;
+		} else {
+			ss->tlsoffered = 0;
+			reply("220 TLS now\r\n");
+			STATINC(stats->counters[ST_TLS_HANDSHAKES]);
+			ss->tlsstart = TSTART();
+			/* Anything the client sent in plaintext after STARTTLS was
+			 * injected by a third party, so don't act upon it. */
+			cn->inhead = cn->intail = 0;
+			cn->starttls = 1;
+			/* The client has to start over with EHLO (RFC 3207, 4.2). */
+			reset();
+			strcpy(ss->tstat.cl_domain, "<DOMAIN UNKNOWN>");
+		}
+		break;
+	case VERB_MAIL:
+		domail();
+		break;
+	case VERB_RCPT:
+		dorcpt();
+		break;
+	case VERB_DATA:
+		dodata();
+		break;
+	case VERB_BDAT:
+		dobdat();
+		break;
+	case VERB_NOOP:
+		if (pcrlf()) {
+			reply("250 OK\r\n");
+		} else {
+			reply("501 Syntax Error\r\n");
+			++ss->tstat.total_viols;
+		}
+		break;
+	case VERB_RSET:
+		if (pcrlf()) {
+			reset();
+			reply("250 OK\r\n");
+		} else {
+			reply("501 Syntax Error\r\n");
+			++ss->tstat.total_viols;
+		}
+		break;
+	case VERB_QUIT:
+		if (pcrlf()) {
+			reply("221 ");
+			cwritent(my_domain);
+			cwritent(" Bye\r\n");
+			if (cn->tls != NULL) tls_close(cn->tls);
+			ss->state = S_QUIT;
+		} else {
+			reply("501 Syntax Error\r\n");
+			++ss->tstat.total_viols;
+		}
+		break;
+	default:
+		reply("500 Unknown Command\r\n");
+		++ss->tstat.total_viols;
+		break;
+	}
+	if (TRACING) {
+		++ss->trace.commands;
+		ss->trace.cmdtime += stathist(&stats->commands[verb], start);
+	}
+}
 
-	sender.local = sender_local_buf;
-	sender.domain = sender_domain_buf;
-	memset(sender.local, 0, LOCAL_LEN + 1);
-	memset(sender.domain, 0, DOMAIN_LEN + 1);
+struct session *recvnew(int sock, struct tls *tlssrv)
+{
+	struct session *s;
+	if (nspare > 0) {
+		s = spare[--nspare];
+		struct arena arena = s->arena;
+		memset(s, 0, sizeof(*s));
+		s->arena = arena;
+	} else if ((s = calloc(1, sizeof(*s))) == NULL) {
+		ioerr("calloc");
+		close(sock);
+		return NULL;
+	}
+	ss = s, cn = &s->conn;
 
-	cwritent("220 ");
+	cn->sock = sock;
+	if (tlssrv != NULL) {
+		tls_accept_socket(tlssrv, &cn->tls, sock); /* TODO error checkng */
+	}
+	cn->read = cread_plain;
+	cn->write = cwrite_plain;
+
+	ss->state = S_COMMAND;
+	ss->datafd = -1;
+	ss->started = statclock();
+	STATINC(stats->counters[ST_CONNECTIONS]);
+	ss->tstat.start_time = time(NULL);
+	strcpy(ss->tstat.cl_domain, "<DOMAIN UNKNOWN>");
+	ss->sender.local = "";
+	ss->sender.domain = "";
+	rsclear(&ss->rcpts);
+
+	reply("220 ");
 	cwritent(my_domain);
 	cwritent(" Ready\r\n");
-	for (;;) {
-		while (!creadln(line, sizeof(line))) {
-			cwritent("500 Line too Long\r\n");
-			++tstat->total_viols;
-		}
-		cphead = line;
-		if (pword("HELO")) {
-			dohelo(0);
-		} else if (pword("EHLO")) {
-			dohelo(1);
-		} else if (pword("STARTTLS")) {
-			if (pcrlf()) {
-				cwritent("220 TLS now\r\n");
-				cread = cread_tls;
-				cwrite = cwrite_tls;
-				/* TODO reset here? */
-			} else {
-				cwritent("501 Syntax Error\r\n");
-				++tstat->total_viols;
-			}
-		} else if (pword("MAIL")) {
-			domail();
-		} else if (pword("RCPT")) {
-			dorcpt();
-		} else if (pword("DATA")) {
-			dodata();
-		} else if (pword("NOOP")) {
-			if (pcrlf()) {
-				cwritent("250 OK\r\n");
-			} else {
-				cwritent("501 Syntax Error\r\n");
-				++tstat->total_viols;
+	cflush();
+	ss->trace.greeting = TSTOP(&stats->hists[H_GREETING], ss->started);
+	return s;
+}
+
+/* What a session that can't make progress right now is waiting for. */
+static int waiting(void)
+{
+	if (cn->dead) return STEP_DONE;
+	if (cn->wait == POLLOUT) return STEP_OUTPUT;
+	return STEP_INPUT;
+}
+
+int recvstep(struct session *s)
+{
+	char *line;
+	ss = s, cn = &s->conn;
+	for (int budget = STEP_BUDGET; budget > 0 && !cn->dead; --budget) {
+		switch (ss->state) {
+		case S_COMMAND:
+			if (cbusy()) return waiting();
+			switch (creadln(&line, COMMAND_LEN)) {
+			case -1:
+				return waiting();
+			case 0:
+				reply("500 Line too Long\r\n");
+				++ss->tstat.total_viols;
+				break;
+			case 1:
+				command(line, cn->in + cn->inhead - line);
+				break;
 			}
-		} else if (pword("RSET")) {
-			if (pcrlf()) {
-				reset();
-				cwritent("250 OK\r\n");
-			} else {
-				cwritent("501 Syntax Error\r\n");
-				++tstat->total_viols;
+			break;
+		case S_DATA:
+			switch (acdata()) {
+			case -1:
+				return waiting();
+			case 1:
+				enddata();
+				break;
 			}
-		} else if (pword("QUIT")) {
-			if (pcrlf()) {
-				cwritent("221 ");
-				cwritent(my_domain);
-				cwritent(" Bye\r\n");
-				int duration = (int) difftime(time(NULL), tstat->start_time);
-				fprintf(stderr, "%us\t%uV\t%uT\t%uR\t%s\n",
-					duration, tstat->total_viols, tstat->total_trans, tstat->total_rcpts, tstat->cl_domain);
-				if (cntls != NULL) {
-					tls_close(cntls);
-					tls_free(cntls);
+			break;
+		case S_CHUNK:
+			switch (acchunk()) {
+			case -1:
+				return waiting();
+			case 1:
+				ss->state = S_COMMAND;
+				if (ss->rcpts.nrcpts == 0) {
+					reply("554 No valid Recipients\r\n");
+					if (ss->chunklast) reset();
+				} else if (ss->chunklast) {
+					enddata();
+				} else {
+					reply("250 OK\r\n");
 				}
-				exit(0);
-			} else {
-				cwritent("501 Syntax Error\r\n");
-				++tstat->total_viols;
+				break;
 			}
-		} else {
-			cwritent("500 Unknown Command\r\n");
-			++tstat->total_viols;
+			break;
+		case S_COMMIT:
+			if (syncgen < ss->commitgen) return STEP_SYNC;
+			if (cbusy()) return waiting();
+			endcommit(syncfail < ss->commitgen);
+			break;
+		case S_QUIT:
+			return cflush() ? STEP_DONE : waiting();
 		}
 	}
+	return cn->dead ? STEP_DONE : STEP_AGAIN;
+}
+
+void recvfree(struct session *s)
+{
+	ss = s, cn = &s->conn;
+	int duration = (int) difftime(time(NULL), ss->tstat.start_time);
+	fprintf(stderr, "%us\t%uV\t%uT\t%uR\t%s\n",
+		duration, ss->tstat.total_viols, ss->tstat.total_trans, ss->tstat.total_rcpts, ss->tstat.cl_domain);
+	STATADD(stats->counters[ST_VIOLATIONS], ss->tstat.total_viols);
+	STATADD(stats->counters[ST_TRANSACTIONS], ss->tstat.total_trans);
+	STATADD(stats->counters[ST_RECIPIENTS], ss->tstat.total_rcpts);
+	if (TRACING) {
+		struct trace *t = &ss->trace;
+		fprintf(stderr, "T\t%luus greeting\t%luus tls\t%lu commands in %luus\t"
+			"%lu bytes of body in %luus\t%luus commit\n",
+			t->greeting, t->tls, t->commands, t->cmdtime, t->bodybytes, t->body, t->commit);
+	}
+	stathist(&stats->hists[H_SESSION], ss->started);
+	reset();
+	if (cn->tls != NULL) tls_free(cn->tls);
+	close(cn->sock);
+	if (nspare < SPARE_SESSIONS) {
+		artrim(&s->arena);
+		spare[nspare++] = s;
+	} else {
+		arfree(&s->arena);
+		free(s);
+	}
+}
+
+void recvtimeout(struct session *s)
+{
+	ss = s, cn = &s->conn;
+	STATINC(stats->counters[ST_TIMEOUTS]);
+	/* Any replies that are still buffered go out first. */
+	reply("421 ");
+	cwritent(my_domain);
+	cwritent(" Timeout, closing connection\r\n");
+	cflush();
+	recvfree(s);
+}
+
+/* Runs a sync for every byte that comes in, and reports how it went. */
+static void syncer(int in, int out)
+{
+	char c;
+	/* The worker going away ends this. */
+	while (read(in, &c, 1) == 1) {
+		if (queuefd < 0) queuefd = open(".queue", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		int err = queuefd < 0 || syncfs(queuefd) < 0 ? errno : 0;
+		if (write(out, &err, sizeof(err)) != sizeof(err)) break;
+	}
+	_exit(0);
 }
 
+int recvsyncer(void)
+{
+	int req[2], done[2];
+	if (durability != DUR_GROUP) return -1;
+	if (pipe2(req, O_CLOEXEC) < 0 || pipe2(done, O_CLOEXEC) < 0) die("pipe2:");
+	pid_t pid = fork();
+	if (pid < 0) die("fork:");
+	if (pid == 0) {
+		/* Above all, the listening sockets must not outlive the worker. */
+		long maxfd = sysconf(_SC_OPEN_MAX);
+		for (int fd = 3; fd < maxfd; ++fd) {
+			if (fd != req[0] && fd != done[1]) close(fd);
+		}
+		syncer(req[0], done[1]);
+	}
+	close(req[0]);
+	close(done[1]);
+	syncreq = req[1];
+	syncdone = done[0];
+	return syncdone;
+}
+
+void recvsync(void)
+{
+	/* One syncfs() covers the message files and directory entries of all
+	 * waiting sessions, so the cost of a sync is shared among all of them. */
+	++syncstarted;
+	if (syncreq >= 0) {
+		if (write(syncreq, "s", 1) != 1) die("The sync process is gone.");
+		return;
+	}
+	if (queuefd < 0) queuefd = open(".queue", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (queuefd < 0 || syncfs(queuefd) < 0) {
+		ioerr("syncfs");
+		syncfail = syncstarted;
+	}
+	syncgen = syncstarted;
+}
+
+void recvsynced(void)
+{
+	int err;
+	if (read(syncdone, &err, sizeof(err)) != sizeof(err)) die("The sync process is gone.");
+	if (err != 0) {
+		errno = err;
+		ioerr("syncfs");
+		syncfail = syncstarted;
+	}
+	syncgen = syncstarted;
+}
+
+void recvbusy(int sock, int limit)
+{
+	static const char *from[NUM_PEER_KINDS] = {
+		[PEER_IP] = " from your address",
+		[PEER_NET] = " from your network",
+	};
+	char line[DOMAIN_LEN+80];
+	int len = snprintf(line, sizeof(line), "421 %s Too many connections%s, try again later\r\n",
+		my_domain, limit >= 0 ? from[limit] : "");
+	STATINC(stats->counters[ST_REFUSED]);
+	if (limit >= 0) STATINC(stats->counters[ST_THROTTLED]);
+	STATINC(stats->replies[421]);
+	/* The reply fits into the empty socket buffer, unless the client is gone. */
+	if (write(sock, line, len) < 0) {
+		/* Then there is nobody to tell. */
+	}
+	close(sock);
+}
+
+void recvmail(int sock, struct tls *tlssrv)
+{
+	struct session *s;
+	int r;
+	if ((s = recvnew(sock, tlssrv)) == NULL) exit(1);
+	while ((r = recvstep(s)) != STEP_DONE) {
+		if (r == STEP_SYNC) recvsync();
+	}
+	recvfree(s);
+	exit(0);
+}
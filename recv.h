@@ -0,0 +1,51 @@
+/* See LICENSE file for copyright and license details. */
+
+/* needs tls.h */
+
+struct session;
+
+/* Results of recvstep(). */
+enum {
+	STEP_DONE,   /* The session is over and should be freed. */
+	STEP_INPUT,  /* The session is waiting for more input. */
+	STEP_AGAIN,  /* The session gave other sessions a chance to run, and must be
+	              * stepped again soon even if no new input arrives. */
+	STEP_OUTPUT, /* The session is waiting until it can send its replies. */
+	STEP_SYNC,   /* The session is waiting until recvsync() made its message durable. */
+};
+
+/* When to make accepted messages durable. */
+enum {
+	DUR_NONE,    /* Never; leave it to the kernel. */
+	DUR_MESSAGE, /* Sync every message before acknowledging it. */
+	DUR_GROUP,   /* Sync the messages of many sessions at once in recvsync(). */
+};
+
+/* Sets up an SMTP session on the connected socket sock and greets the client.
+ * tlssrv may be NULL if STARTTLS is not to be offered. */
+struct session *recvnew(int sock, struct tls *tlssrv);
+/* Processes whatever input is available on the session's connection,
+ * and tells what needs to happen next with one of the STEP_* values. */
+int recvstep(struct session *s);
+/* Closes the session's connection and releases all its resources. */
+void recvfree(struct session *s);
+/* Tells the client that its session is closed for being idle for too long,
+ * then frees the session like recvfree(). */
+void recvtimeout(struct session *s);
+/* Starts a process that runs the syncs of recvsync() from then on, so that
+ * the caller can go on in the meantime. Returns a descriptor that becomes
+ * readable when a sync is done, or -1 if messages aren't synced in groups. */
+int recvsyncer(void);
+/* Flushes the messages of all sessions that returned STEP_SYNC to disk.
+ * Step them again afterwards so they can acknowledge their messages. With
+ * recvsyncer(), this only starts the sync, and the sessions have to wait
+ * until it is done and recvsynced() was called. Only one may run at a time. */
+void recvsync(void);
+/* Takes note of the result of the sync that recvsync() started. */
+void recvsynced(void);
+/* Turns the client on the connected socket sock away with 421, for when there
+ * are too many sessions already, and closes the socket. limit is the kind of
+ * limit (PEER_*) that this client has hit, or -1 if the server is full. */
+void recvbusy(int sock, int limit);
+/* Runs a whole session on a blocking socket and exits the process afterwards. */
+void recvmail(int sock, struct tls *tlssrv);
@@ -1,41 +1,86 @@
 /* See LICENSE file for copyright and license details. */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <assert.h>
 
+#ifdef __SSE2__
+# include <immintrin.h>
+#endif
+
 #include "smtp.h"
 
 char *cphead;
+char *cpend;
+
+/* Bits in ctab for the character classes. */
+#define CL_LOCAL  1
+#define CL_ADDR   2
+#define CL_DOMAIN 4
+
+/* The character classes of all bytes. Non-ASCII bytes are in none of them.
+ *   local:  !#$%&'*+-./09=?AZ^_`az{|}~
+ *   addr:   anything except whitespace and [\]
+ *   domain: -.09AZaz */
+static const unsigned char ctab[256] = {
+	/* 0x00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 0x20 */ 0, 3, 2, 3, 3, 3, 3, 3, 2, 2, 3, 3, 2, 7, 7, 3,
+	/* 0x30 */ 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 2, 2, 2, 3, 2, 3,
+	/* 0x40 */ 2, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	/* 0x50 */ 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 0, 0, 0, 3, 3,
+	/* 0x60 */ 3, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	/* 0x70 */ 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 3, 3, 3, 3, 0,
+};
 
 int islocalc(char c)
 {
-	/* !#$%&'*+-./09=?AZ^_`az{|}~ */
-	if (c == 33) return 1;
-	if (c > 34 && c < 40) return 1;
-	if (c == 42 || c == 43) return 1;
-	if (c > 44 && c < 58) return 1;
-	if (c == 61) return 1;
-	if (c > 64 && c <  91) return 1;
-	if (c > 93 && c < 127) return 1;
-	return 0;
+	return ctab[(unsigned char) c] & CL_LOCAL;
 }
 
 int isaddrc(char c)
 {
-	/* anything except whitespace and [\] */
-	if (c > 32 && c <  91) return 1;
-	if (c > 93 && c < 127) return 1;
-	return 0;
+	return ctab[(unsigned char) c] & CL_ADDR;
 }
 
 int isdomainc(char c)
 {
-	/* -.AZaz */
-	if (c == 45 || c == 46) return 1;
-	if (c > 64 && c <  91) return 1;
-	if (c > 96 && c < 123) return 1;
-	return 0;
+	return ctab[(unsigned char) c] & CL_DOMAIN;
+}
+
+/* Returns the length of the run of characters of class cl at p. */
+static size_t span(const char *p, int cl)
+{
+	size_t n = 0, left = cpend - p;
+	for (;;) {
+#ifdef __SSE2__
+		/* Letters, digits, dots and dashes are in every class and make up
+		 * most of any address, so skip over those 16 at a time. */
+		const __m128i lc = _mm_set1_epi8(0x20);
+		while (left - n >= 16) {
+			__m128i x = _mm_loadu_si128((const __m128i *) (p + n));
+			__m128i l = _mm_or_si128(x, lc);
+			__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+				_mm_cmplt_epi8(l, _mm_set1_epi8('z' + 1)));
+			__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)),
+				_mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+			__m128i punct = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('-')),
+				_mm_cmpeq_epi8(x, _mm_set1_epi8('.')));
+			unsigned mask = _mm_movemask_epi8(_mm_or_si128(alpha, _mm_or_si128(digit, punct)));
+			if (mask != 0xFFFF) {
+				n += __builtin_ctz(~mask);
+				break;
+			}
+			n += 16;
+		}
+#endif
+		/* Everything else, and the last few bytes, go through the table. */
+		if (n == left || !(ctab[(unsigned char) p[n]] & cl)) break;
+		++n;
+	}
+	return n;
 }
 
 int pchar(char ch)
@@ -55,8 +100,9 @@ int pword(char *exp)
 	char *head = cphead;
 	do {
 		char ec = *exp;
-		assert(ec > 64 && ec < 91);
-		char hc = *head & 0xDF;
+		assert(ec > 32 && ec < 91 && !(ec > 96 && ec < 123));
+		char hc = *head;
+		if (ec > 64) hc &= 0xDF;
 		if (ec != hc) return 0;
 		++exp, ++head;
 	} while (*exp);
@@ -64,40 +110,87 @@ int pword(char *exp)
 	return 1;
 }
 
+/* Packs four characters into a word, in the same order as a load from memory. */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+# define WORD4(a, b, c, d) \
+	((uint32_t) (a) << 24 | (uint32_t) (b) << 16 | (uint32_t) (c) << 8 | (uint32_t) (d))
+#else
+# define WORD4(a, b, c, d) \
+	((uint32_t) (d) << 24 | (uint32_t) (c) << 16 | (uint32_t) (b) << 8 | (uint32_t) (a))
+#endif
+
+/* Setting bit 5 lowercases all letters, and turns nothing else into one. */
+#define FOLD4 0x20202020u
+
+int pverb(int len)
+{
+	uint32_t w;
+	int verb;
+	if (len < 4) return VERB_UNKNOWN;
+	memcpy(&w, cphead, 4);
+	switch (w | FOLD4) {
+	case WORD4('h', 'e', 'l', 'o'): verb = VERB_HELO; break;
+	case WORD4('e', 'h', 'l', 'o'): verb = VERB_EHLO; break;
+	case WORD4('m', 'a', 'i', 'l'): verb = VERB_MAIL; break;
+	case WORD4('r', 'c', 'p', 't'): verb = VERB_RCPT; break;
+	case WORD4('d', 'a', 't', 'a'): verb = VERB_DATA; break;
+	case WORD4('b', 'd', 'a', 't'): verb = VERB_BDAT; break;
+	case WORD4('n', 'o', 'o', 'p'): verb = VERB_NOOP; break;
+	case WORD4('r', 's', 'e', 't'): verb = VERB_RSET; break;
+	case WORD4('q', 'u', 'i', 't'): verb = VERB_QUIT; break;
+	case WORD4('s', 't', 'a', 'r'):
+		/* The only verb with more than four letters. */
+		if (len < 8) return VERB_UNKNOWN;
+		memcpy(&w, cphead + 4, 4);
+		if ((w | FOLD4) != WORD4('t', 't', 'l', 's')) return VERB_UNKNOWN;
+		cphead += 4;
+		verb = VERB_STARTTLS;
+		break;
+	default:
+		return VERB_UNKNOWN;
+	}
+	cphead += 4;
+	return verb;
+}
+
 int plocal(char str[])
 {
-	char *c = cphead;
 	/* TODO quoted local */
-	if (!islocalc(*c)) return 0;
-	int i = 0;
-	do {
-		if (i >= LOCAL_LEN) return 0;
-		str[i++] = *c++;
-	} while (islocalc(*c));
-	str[i] = 0;
-	cphead = c;
+	size_t n = span(cphead, CL_LOCAL);
+	if (n == 0 || n > LOCAL_LEN) return 0;
+	memcpy(str, cphead, n);
+	str[n] = 0;
+	cphead += n;
 	return 1;
 }
 
 int pdomain(char str[])
 {
-	char *c = cphead;
-	int i = 0;
-	if (*c == '[') {
-		do {
-			if (i >= DOMAIN_LEN-1) return 0;
-			str[i++] = *c++;
-		} while (isaddrc(*c));
-		if (*c != ']') return 0;
-		str[i++] = *c++;
+	size_t n;
+	if (*cphead == '[') {
+		n = 1 + span(cphead + 1, CL_ADDR);
+		if (n > DOMAIN_LEN-1 || cphead[n] != ']') return 0;
+		++n;
 	} else {
-		if (!isdomainc(*c)) return 0;
-		do {
-			if (i >= DOMAIN_LEN) return 0;
-			str[i++] = *c++;
-		} while (isdomainc(*c));
+		n = span(cphead, CL_DOMAIN);
+		if (n == 0 || n > DOMAIN_LEN) return 0;
 	}
-	str[i] = 0;
+	memcpy(str, cphead, n);
+	str[n] = 0;
+	cphead += n;
+	return 1;
+}
+
+int pnum(unsigned long *num)
+{
+	char *c = cphead;
+	unsigned long n = 0;
+	if (!(*c >= '0' && *c <= '9')) return 0;
+	do {
+		if (c - cphead >= 9) return 0;
+		n = 10 * n + (*c++ - '0');
+	} while (*c >= '0' && *c <= '9');
+	*num = n;
 	cphead = c;
 	return 1;
 }
@@ -107,22 +200,78 @@ int pmailbox(char local[], char domain[])
 	return plocal(local) && pchar('@') && pdomain(domain);
 }
 
+const char *dotscan(const char *p, const char *end)
+{
+#ifdef __AVX2__
+	const __m256i cr32 = _mm256_set1_epi8('\r');
+	const __m256i lf32 = _mm256_set1_epi8('\n');
+	const __m256i dot32 = _mm256_set1_epi8('.');
+	while (end - p >= 34) {
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), cr32);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 1)), lf32);
+		__m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 2)), dot32);
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(a, _mm256_and_si256(b, c)));
+		if (mask) return p + __builtin_ctz(mask);
+		p += 32;
+	}
+#endif
+#ifdef __SSE2__
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i dot = _mm_set1_epi8('.');
+	while (end - p >= 18) {
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), cr);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 1)), lf);
+		__m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 2)), dot);
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(a, _mm_and_si128(b, c)));
+		if (mask) return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (end - p >= 3 && (p = memchr(p, '\r', end - p - 2)) != NULL) {
+		if (p[1] == '\n' && p[2] == '.') return p;
+		++p;
+	}
+	return NULL;
+}
+
 int phelo(char domain[])
 {
 	return pchar(' ') && pdomain(domain) && pcrlf();
 }
 
-int pmail(char local[], char domain[])
+int pbody(int *body)
+{
+	if (!pword("BODY=")) return 0;
+	if (pword("7BIT")) *body = BODY_7BIT;
+	else if (pword("8BITMIME")) *body = BODY_8BITMIME;
+	else if (pword("BINARYMIME")) *body = BODY_BINARYMIME;
+	else return 0;
+	return *cphead == ' ' || *cphead == '\r';
+}
+
+int pmail(char local[], char domain[], int *body)
 {
 	int s =  pchar(' ') && pword("FROM") && pchar(':');
 	s = s && pchar('<') && pmailbox(local, domain) && pchar('>');
-	return   pcrlf();
+	*body = BODY_7BIT;
+	while (s && *cphead == ' ') {
+		s = pchar(' ') && pbody(body);
+	}
+	return s && pcrlf();
 }
 
 int prcpt(char local[], char domain[])
 {
 	int s =  pchar(' ') && pword("TO") && pchar(':');
 	s = s && pchar('<') && pmailbox(local, domain) && pchar('>');
-	return   pcrlf();
+	return s && pcrlf();
+}
+
+int pbdat(unsigned long *size, int *last)
+{
+	int s = pchar(' ') && pnum(size);
+	*last = s && pchar(' ') && pword("LAST");
+	return s && pcrlf();
 }
 
@@ -4,8 +4,34 @@
 #define DOMAIN_LEN 255
 #define COMMAND_LEN 512
 
+/* Values of the BODY parameter of the MAIL command. */
+enum {
+	BODY_7BIT,
+	BODY_8BITMIME,
+	BODY_BINARYMIME,
+};
+
+/* Command verbs, as told apart by pverb(). */
+enum {
+	VERB_UNKNOWN,
+	VERB_HELO,
+	VERB_EHLO,
+	VERB_STARTTLS,
+	VERB_MAIL,
+	VERB_RCPT,
+	VERB_DATA,
+	VERB_BDAT,
+	VERB_NOOP,
+	VERB_RSET,
+	VERB_QUIT,
+	NUM_VERBS
+};
+
 /* Current read head. Used and modified by all SMTP parsing functions. */
 extern char *cphead;
+/* End of the line that cphead is in. Runs of address characters end there
+ * at the latest, and nothing at or behind it is read to find them. */
+extern char *cpend;
 
 /* Is c a valid character in the local part of an e-mail address? */
 int islocalc(char c);
@@ -23,8 +49,14 @@ int isdomainc(char c);
 int pchar(char ch);
 /* Matches CR LF. */
 int pcrlf(void);
-/* Matches the word exp. exp may only consist of uppercase ASCII characters. */
+/* Matches the word exp. exp may only consist of uppercase ASCII characters,
+ * digits and punctuation. Letters are matched case-insensitively. */
 int pword(char *exp);
+/* Matches the verb at the start of a command line of len bytes and returns
+ * its VERB_* value. Unknown verbs give VERB_UNKNOWN and don't advance cphead. */
+int pverb(int len);
+/* Parses a decimal number of up to 9 digits. */
+int pnum(unsigned long *num);
 /* Parses the local part of an e-mail address, and returns it in str. */
 int plocal(char str[]);
 /* Parses the domain part of an e-mail address, and returns it in str. */
@@ -32,8 +64,15 @@ int pdomain(char str[]);
 /* Parses an e-mail address, and returns the local and domain part separately. */
 int pmailbox(char local[], char domain[]);
 
+/* Finds the first CR LF in [p, end) that is directly followed by a dot,
+ * i.e. the next line of a message body that needs dot-unstuffing or is the
+ * end-of-data marker. Returns a pointer to the CR, or NULL if there is none. */
+const char *dotscan(const char *p, const char *end);
+
 /* SMTP server-specific parsing functions. */
 int phelo(char domain[]);
-int pmail(char local[], char domain[]);
+int pbody(int *body);
+int pmail(char local[], char domain[], int *body);
 int prcpt(char local[], char domain[]);
+int pbdat(unsigned long *size, int *last);
 
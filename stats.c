@@ -0,0 +1,170 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE /* for accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "smtp.h"
+#include "util.h"
+#include "stats.h"
+
+struct stats *stats;
+int tracing;
+
+static const char *counternames[NUM_COUNTERS] = {
+	[ST_CONNECTIONS] = "connections",
+	[ST_TLS_HANDSHAKES] = "tls_handshakes",
+	[ST_VIOLATIONS] = "violations",
+	[ST_TRANSACTIONS] = "transactions",
+	[ST_RECIPIENTS] = "recipients",
+	[ST_MESSAGES] = "messages",
+	[ST_BYTES] = "spooled_bytes",
+	[ST_REFUSED] = "refused_connections",
+	[ST_THROTTLED] = "throttled_connections",
+	[ST_TIMEOUTS] = "timed_out_sessions",
+};
+
+static const char *histnames[NUM_HISTS] = {
+	[H_SESSION] = "session",
+	[H_COMMIT] = "commit",
+	[H_GREETING] = "greeting",
+	[H_TLS] = "tls",
+	[H_BODY] = "body",
+	[H_ENVELOPE] = "envelope",
+	[H_PUBLISH] = "publish",
+};
+
+static const char *verbnames[NUM_VERBS] = {
+	[VERB_UNKNOWN] = "unknown",
+	[VERB_HELO] = "helo",
+	[VERB_EHLO] = "ehlo",
+	[VERB_STARTTLS] = "starttls",
+	[VERB_MAIL] = "mail",
+	[VERB_RCPT] = "rcpt",
+	[VERB_DATA] = "data",
+	[VERB_BDAT] = "bdat",
+	[VERB_NOOP] = "noop",
+	[VERB_RSET] = "rset",
+	[VERB_QUIT] = "quit",
+};
+
+#define LOAD(ctr) __atomic_load_n(&(ctr), __ATOMIC_RELAXED)
+
+void statinit(void)
+{
+	stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) die("mmap:");
+}
+
+unsigned long statclock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+unsigned long stathist(struct hist *hist, unsigned long start)
+{
+	unsigned long us = statclock() - start;
+	/* Bucket b holds everything below 2^b us. */
+	int b = us == 0 ? 0 : CHAR_BIT * sizeof(us) - __builtin_clzl(us);
+	if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+	STATINC(hist->buckets[b]);
+	STATINC(hist->count);
+	STATADD(hist->sum, us);
+	return us;
+}
+
+/* Writes hist as the histogram name, with label if that isn't empty. */
+static void dumphist(FILE *fp, const char *name, const char *label, struct hist *hist)
+{
+	const char *sep = label[0] != '\0' ? "," : "";
+	unsigned long cum = 0;
+	for (int b = 0; b < HIST_BUCKETS - 1; ++b) {
+		cum += LOAD(hist->buckets[b]);
+		fprintf(fp, "bmail_%s_seconds_bucket{%s%sle=\"%.6f\"} %lu\n",
+			name, label, sep, (double) (1UL << b) / 1e6, cum);
+	}
+	cum += LOAD(hist->buckets[HIST_BUCKETS - 1]);
+	fprintf(fp, "bmail_%s_seconds_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, sep, cum);
+	if (label[0] != '\0') {
+		fprintf(fp, "bmail_%s_seconds_sum{%s} %.6f\n", name, label, LOAD(hist->sum) / 1e6);
+		fprintf(fp, "bmail_%s_seconds_count{%s} %lu\n", name, label, LOAD(hist->count));
+	} else {
+		fprintf(fp, "bmail_%s_seconds_sum %.6f\n", name, LOAD(hist->sum) / 1e6);
+		fprintf(fp, "bmail_%s_seconds_count %lu\n", name, LOAD(hist->count));
+	}
+}
+
+void statdump(FILE *fp)
+{
+	for (int c = 0; c < NUM_COUNTERS; ++c) {
+		fprintf(fp, "bmail_%s_total %lu\n", counternames[c], LOAD(stats->counters[c]));
+	}
+	fprintf(fp, "bmail_active_sessions %ld\n", LOAD(stats->active));
+	for (int v = 0; v < NUM_VERBS; ++v) {
+		fprintf(fp, "bmail_commands_total{verb=\"%s\"} %lu\n", verbnames[v], LOAD(stats->verbs[v]));
+	}
+	for (int code = 0; code < MAX_CODE; ++code) {
+		unsigned long n = LOAD(stats->replies[code]);
+		if (n > 0) fprintf(fp, "bmail_replies_total{code=\"%d\"} %lu\n", code, n);
+	}
+	for (int h = 0; h < NUM_HISTS; ++h) {
+		if (h > H_COMMIT && !TRACING) break;
+		dumphist(fp, histnames[h], "", &stats->hists[h]);
+	}
+	for (int v = 0; TRACING && v < NUM_VERBS; ++v) {
+		char label[32];
+		sprintf(label, "verb=\"%s\"", verbnames[v]);
+		dumphist(fp, "command", label, &stats->commands[v]);
+	}
+	fflush(fp);
+}
+
+int statlisten(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(sun.sun_path)) die("The stats socket path is too long.");
+	strcpy(sun.sun_path, path);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) die("socket:");
+	/* Clear away the socket of an earlier run. */
+	unlink(path);
+	if (bind(sock, (struct sockaddr *) &sun, sizeof(sun)) < 0) die("bind %s:", path);
+	if (listen(sock, 8) < 0) die("listen:");
+	return sock;
+}
+
+void statserve(int sock)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	int fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		ioerr("accept");
+		return;
+	}
+	/* The dump is put together in memory and handed over in one go, so a
+	 * client that stalls or goes away can neither hold up the master nor
+	 * get it killed by SIGPIPE. Whatever doesn't fit into the socket buffer
+	 * is lost to a client that doesn't keep up. */
+	FILE *fp = open_memstream(&buf, &len);
+	if (fp == NULL) {
+		close(fd);
+		return;
+	}
+	statdump(fp);
+	if (fclose(fp) == 0 && send(fd, buf, len, MSG_NOSIGNAL) < 0) {
+		/* Then there is nobody to tell. */
+	}
+	free(buf);
+	close(fd);
+}
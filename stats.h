@@ -0,0 +1,93 @@
+/* See LICENSE file for copyright and license details. */
+
+/* needs smtp.h */
+
+/* Metrics that all processes update without locks or system calls. They live
+ * in shared memory that the master sets up before forking, so they sum up all
+ * workers and sessions, and the master can dump them at any time. */
+
+/* Latency histograms have one bucket per power of two of microseconds. */
+#define HIST_BUCKETS 28
+/* Replies are counted by status code, which is always below this. */
+#define MAX_CODE 600
+
+enum {
+	ST_CONNECTIONS,
+	ST_TLS_HANDSHAKES,
+	ST_VIOLATIONS,
+	ST_TRANSACTIONS,
+	ST_RECIPIENTS,
+	ST_MESSAGES,
+	ST_BYTES,
+	ST_REFUSED,
+	ST_THROTTLED,
+	ST_TIMEOUTS,
+	NUM_COUNTERS
+};
+
+enum {
+	H_SESSION,  /* From accepting a connection to closing it. */
+	H_COMMIT,   /* From the end of the body to the reply, including syncs. */
+	/* Only while tracing: */
+	H_GREETING, /* From accepting a connection to sending the greeting. */
+	H_TLS,      /* From STARTTLS to the first command over TLS. */
+	H_BODY,     /* From DATA or the first BDAT to the end of the body. */
+	H_ENVELOPE, /* Creating, writing and syncing one envelope. */
+	H_PUBLISH,  /* Linking a message and its envelope into the queue. */
+	NUM_HISTS
+};
+
+struct hist
+{
+	unsigned long buckets[HIST_BUCKETS];
+	unsigned long count;
+	/* In microseconds. */
+	unsigned long sum;
+};
+
+struct stats
+{
+	unsigned long counters[NUM_COUNTERS];
+	/* Sessions that are open right now. They are counted along with the load
+	 * (see event.h), which the master corrects for sessions whose process died. */
+	long active;
+	/* How often each command verb was received. */
+	unsigned long verbs[NUM_VERBS];
+	unsigned long replies[MAX_CODE];
+	struct hist hists[NUM_HISTS];
+	/* Only while tracing: How long the handling of each verb took. */
+	struct hist commands[NUM_VERBS];
+};
+
+extern struct stats *stats;
+/* Is phase tracing turned on? */
+extern int tracing;
+
+#define STATADD(ctr, n) __atomic_fetch_add(&(ctr), (n), __ATOMIC_RELAXED)
+#define STATINC(ctr) STATADD(ctr, 1)
+
+/* Phase tracing adds up the time spent in the phases of a session.
+ * Compile with -DNO_TRACE to leave it out entirely. */
+#ifdef NO_TRACE
+# define TRACING 0
+#else
+# define TRACING tracing
+#endif
+/* The start of a phase, or 0 if tracing is off. */
+#define TSTART() (TRACING ? statclock() : 0)
+/* Ends a phase, and evaluates to its length in microseconds. */
+#define TSTOP(hist, start) (TRACING ? stathist(hist, start) : 0)
+
+/* Sets up the metrics. Has to be called before any workers are forked. */
+void statinit(void);
+/* Returns the current time in microseconds, for use with stathist(). */
+unsigned long statclock(void);
+/* Adds the time that has passed since start to hist, and returns it. */
+unsigned long stathist(struct hist *hist, unsigned long start);
+/* Writes all metrics to fp in the Prometheus text format. */
+void statdump(FILE *fp);
+/* Listens for connections on the UNIX socket at path, each of which gets a
+ * dump of the metrics. Returns the listening socket. */
+int statlisten(const char *path);
+/* Serves one connection to the socket from statlisten(). */
+void statserve(int sock);
@@ -71,6 +71,16 @@ unsigned long pcrandom32(void)
 #endif
 }
 
+unsigned long fnv1a(const char *str)
+{
+	uint32_t h = 2166136261u;
+	for (const char *c = str; *c; ++c) {
+		h ^= (unsigned char) *c;
+		h *= 16777619u;
+	}
+	return h;
+}
+
 void catpath(char *buf, char *first, ...)
 {
 	size_t len = strlen(first);
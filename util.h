@@ -12,5 +12,7 @@ void handlesignals(void (*handler)(int));
 void reapchildren(void);
 /* Portably generate cryptographic random 32-bit numbers. */
 unsigned long pcrandom32(void);
+/* 32-bit FNV-1a hash of a string. */
+unsigned long fnv1a(const char *str);
 
 void catpath(char *buf, char *first, ...);